@@ -0,0 +1,444 @@
+//End-to-end archive benchmark. Synthesises .lst trees of a given shape (entry count, size
+//distribution, content and codec mix), then runs the tool to rebuild them into an archive and
+//extract that archive again, reporting wall time, throughput and peak RSS for every phase.
+//
+//Build it with the corpus generators and point it at a build of the tool, e.g.:
+//    cc -O2 -c bench/corpus.c
+//    c++ -O2 -o archivebench bench/archivebench.cpp corpus.o
+//    ./archivebench --tool ./mpdsarchivetool --shape large --shape small -- -j 8
+//Anything after -- is passed to the tool. POSIX only, as the tool is run with fork/exec.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "corpus.h"
+
+enum SizeDistribution {
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_LOG_UNIFORM
+};
+
+struct ArchiveShape {
+    std::string m_name;
+    uint32_t m_num_entries = 100;
+    uint32_t m_min_size = 4096;
+    uint32_t m_max_size = 4096;
+    SizeDistribution m_distribution = SIZE_FIXED;
+    std::string m_content = "asset";
+    std::vector<std::string> m_codecs = { "COMPRESSION_LZ77" };
+    std::string m_outer = "COMPRESSION_NONE";
+};
+
+struct PhaseResult {
+    std::string m_name;
+    double m_seconds = 0;
+    uint64_t m_bytes = 0;
+    long m_peak_rss_kb = 0;
+};
+
+//Presets for the shapes that matter in practice: a few huge entries, where codec speed
+//dominates, and thousands of tiny ones, where per-file overhead does
+bool GetPresetShape(std::string name, ArchiveShape &shape)
+{
+    shape = ArchiveShape();
+    shape.m_name = name;
+    if (name == "large") {
+        shape.m_num_entries = 10;
+        shape.m_min_size = shape.m_max_size = 4 * 1024 * 1024;
+    } else if (name == "small") {
+        shape.m_num_entries = 5000;
+        shape.m_min_size = shape.m_max_size = 2048;
+    } else if (name == "mixed") {
+        //Kept well below 16 MB in total, the most an LZ77-compressed archive can hold
+        shape.m_num_entries = 200;
+        shape.m_min_size = 256;
+        shape.m_max_size = 256 * 1024;
+        shape.m_distribution = SIZE_LOG_UNIFORM;
+        shape.m_content = "mixed";
+        shape.m_codecs = { "COMPRESSION_LZ77", "COMPRESSION_LZ77", "COMPRESSION_LZ11", "COMPRESSION_NONE", "COMPRESSION_HUFFMAN_8" };
+        shape.m_outer = "COMPRESSION_LZ77";
+    } else {
+        return false;
+    }
+    return true;
+}
+
+uint32_t PickEntrySize(const ArchiveShape &shape, BENCHRNG &rng)
+{
+    double t = (benchRandom(&rng) & 0xFFFFFF) / (double)0xFFFFFF;
+    switch (shape.m_distribution) {
+        case SIZE_UNIFORM:
+            return shape.m_min_size + (uint32_t)(t * (shape.m_max_size - shape.m_min_size));
+        case SIZE_LOG_UNIFORM:
+            //Many small entries and a few large ones, as in real archives
+            return (uint32_t)exp(log((double)shape.m_min_size) + t * (log((double)shape.m_max_size) - log((double)shape.m_min_size)));
+        default:
+            return shape.m_min_size;
+    }
+}
+
+bool WriteFile(std::string path, const unsigned char *data, size_t size)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    size_t nbytes = fwrite(data, 1, size, file);
+    fclose(file);
+    return nbytes == size;
+}
+
+bool ReadFile(std::string path, std::vector<unsigned char> &data)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+//Writes work_dir/name.lst and the entries it lists to work_dir/name/
+bool GenerateTree(const ArchiveShape &shape, std::string work_dir, uint64_t &total_size)
+{
+    std::string entry_dir = work_dir + "/" + shape.m_name;
+    if (mkdir(entry_dir.c_str(), 0777) != 0 && errno != EEXIST) {
+        std::cout << "Failed to create " << entry_dir << "." << std::endl;
+        return false;
+    }
+    std::ofstream list(work_dir + "/" + shape.m_name + ".lst");
+    if (!list.is_open()) {
+        std::cout << "Failed to create " << shape.m_name << ".lst." << std::endl;
+        return false;
+    }
+    list << shape.m_outer << std::endl << std::endl;
+    BENCHRNG rng = { 0x9E3779B9u ^ shape.m_num_entries };
+    std::vector<unsigned char> buffer;
+    total_size = 0;
+    for (uint32_t i = 0; i < shape.m_num_entries; i++) {
+        uint32_t size = PickEntrySize(shape, rng);
+        const BENCHCORPUS *corpus = benchFindCorpus(shape.m_content.c_str());
+        if (!corpus) {
+            //Mixed content picks a corpus per entry, with asset data standing in for the
+            //all-zero corpus, which no real entry looks like
+            corpus = &benchCorpora[benchRandom(&rng) % benchNumCorpora];
+            if (corpus->generate == genZeros) {
+                corpus = benchFindCorpus("asset");
+            }
+        }
+        buffer.resize(size);
+        corpus->generate(buffer.data(), size, &rng);
+        std::string filename = std::to_string(i) + ".bin";
+        if (!WriteFile(entry_dir + "/" + filename, buffer.data(), size)) {
+            std::cout << "Failed to write " << entry_dir << "/" << filename << "." << std::endl;
+            return false;
+        }
+        list << shape.m_codecs[benchRandom(&rng) % shape.m_codecs.size()] << "," << shape.m_name << "/" << filename << std::endl;
+        total_size += size;
+    }
+    return true;
+}
+
+//Runs the tool and measures it from the outside, so the numbers include process startup,
+//file handling and everything else a user waits for
+bool RunTool(std::string tool, const std::vector<std::string> &tool_args, std::string in_name, std::string out_name, PhaseResult &phase)
+{
+    std::vector<std::string> args;
+    args.push_back(tool);
+    args.insert(args.end(), tool_args.begin(), tool_args.end());
+    args.push_back(in_name);
+    args.push_back(out_name);
+    std::vector<char *> argv;
+    for (size_t i = 0; i < args.size(); i++) {
+        argv.push_back((char *)args[i].c_str());
+    }
+    argv.push_back(NULL);
+    fflush(stdout);
+    double start = benchNow();
+    pid_t pid = fork();
+    if (pid == 0) {
+        //Keep the tool's progress messages out of the report
+        freopen("/dev/null", "w", stdout);
+        execv(tool.c_str(), argv.data());
+        _exit(127);
+    }
+    if (pid < 0) {
+        return false;
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) {
+        return false;
+    }
+    phase.m_seconds = benchNow() - start;
+    phase.m_peak_rss_kb = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+//Checks every extracted entry against its source. Uncompressed entries come back with their
+//alignment padding, so up to three trailing bytes are allowed
+bool VerifyTree(const ArchiveShape &shape, std::string work_dir, std::string extract_name)
+{
+    std::vector<unsigned char> original;
+    std::vector<unsigned char> extracted;
+    for (uint32_t i = 0; i < shape.m_num_entries; i++) {
+        std::string filename = std::to_string(i) + ".bin";
+        if (!ReadFile(work_dir + "/" + shape.m_name + "/" + filename, original) || !ReadFile(work_dir + "/" + extract_name + "/" + filename, extracted)) {
+            std::cerr << "Entry " << i << " of " << shape.m_name << " is missing." << std::endl;
+            return false;
+        }
+        if (extracted.size() < original.size() || extracted.size() - original.size() > 3 || !std::equal(original.begin(), original.end(), extracted.begin())) {
+            std::cerr << "Entry " << i << " of " << shape.m_name << " does not match its source." << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void RemoveTree(std::string dir, uint32_t num_entries)
+{
+    for (uint32_t i = 0; i < num_entries; i++) {
+        unlink((dir + "/" + std::to_string(i) + ".bin").c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+bool ParseShapeOption(ArchiveShape &shape, std::string option, std::string value)
+{
+    if (option == "-n") {
+        shape.m_num_entries = strtoul(value.c_str(), NULL, 10);
+        return shape.m_num_entries > 0;
+    } else if (option == "--size") {
+        //MIN or MIN:MAX
+        size_t colon_pos = value.find(':');
+        shape.m_min_size = strtoul(value.c_str(), NULL, 10);
+        shape.m_max_size = colon_pos == std::string::npos ? shape.m_min_size : strtoul(value.c_str() + colon_pos + 1, NULL, 10);
+        if (shape.m_min_size != shape.m_max_size && shape.m_distribution == SIZE_FIXED) {
+            shape.m_distribution = SIZE_UNIFORM;
+        }
+        return shape.m_min_size > 0 && shape.m_max_size >= shape.m_min_size && shape.m_max_size <= 0xFFFFFF;
+    } else if (option == "--dist") {
+        if (value == "fixed") {
+            shape.m_distribution = SIZE_FIXED;
+        } else if (value == "uniform") {
+            shape.m_distribution = SIZE_UNIFORM;
+        } else if (value == "log") {
+            shape.m_distribution = SIZE_LOG_UNIFORM;
+        } else {
+            return false;
+        }
+        return true;
+    } else if (option == "--content") {
+        shape.m_content = value;
+        return value == "mixed" || benchFindCorpus(value.c_str()) != NULL;
+    } else if (option == "--codecs") {
+        //Entries pick uniformly from the list; repeat a codec to weight it
+        shape.m_codecs.clear();
+        size_t pos = 0;
+        while (pos <= value.size()) {
+            size_t comma_pos = value.find(',', pos);
+            if (comma_pos == std::string::npos) {
+                comma_pos = value.size();
+            }
+            shape.m_codecs.push_back(value.substr(pos, comma_pos - pos));
+            pos = comma_pos + 1;
+        }
+        return !shape.m_codecs.empty();
+    } else if (option == "--outer") {
+        shape.m_outer = value;
+        return true;
+    }
+    return false;
+}
+
+void PrintShapeResult(const ArchiveShape &shape, uint64_t total_size, uint64_t archive_size, const std::vector<PhaseResult> &phases, bool json, bool first)
+{
+    if (json) {
+        std::cout << (first ? "" : ",") << std::endl;
+        printf("\t\t{ \"shape\": \"%s\", \"entries\": %u, \"bytes\": %llu, \"archiveBytes\": %llu, \"phases\": [",
+            shape.m_name.c_str(), shape.m_num_entries, (unsigned long long)total_size, (unsigned long long)archive_size);
+        for (size_t p = 0; p < phases.size(); p++) {
+            printf("%s\n\t\t\t{ \"phase\": \"%s\", \"seconds\": %.4f, \"MBs\": %.2f, \"peakRssKB\": %ld }", p == 0 ? "" : ",",
+                phases[p].m_name.c_str(), phases[p].m_seconds, phases[p].m_bytes / phases[p].m_seconds / 1000000.0, phases[p].m_peak_rss_kb);
+        }
+        printf("\n\t\t] }");
+    } else {
+        for (size_t p = 0; p < phases.size(); p++) {
+            printf("%-10s %8u %12llu %-10s %10.4f %10.2f %12ld\n", shape.m_name.c_str(), shape.m_num_entries, (unsigned long long)total_size,
+                phases[p].m_name.c_str(), phases[p].m_seconds, phases[p].m_bytes / phases[p].m_seconds / 1000000.0, phases[p].m_peak_rss_kb);
+        }
+        printf("%-10s archive is %llu bytes (%.4f of the input)\n", shape.m_name.c_str(), (unsigned long long)archive_size, (double)archive_size / total_size);
+    }
+    fflush(stdout);
+}
+
+void PrintUsage(const char *program)
+{
+    std::cout << "Usage: " << program << " --tool PATH [options] [-- tool options]" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  --tool PATH         The archive tool to benchmark" << std::endl;
+    std::cout << "  --shape NAME        Preset shape: large (10 x 4 MB), small (5000 x 2 KB) or mixed;" << std::endl;
+    std::cout << "                      may be repeated (default: large and small)" << std::endl;
+    std::cout << "  -n N                Entry count of a custom shape" << std::endl;
+    std::cout << "  --size MIN[:MAX]    Entry size range of a custom shape, in bytes" << std::endl;
+    std::cout << "  --dist D            Size distribution: fixed, uniform or log" << std::endl;
+    std::cout << "  --content NAME      Entry content: random, zeros, text, table, asset or mixed" << std::endl;
+    std::cout << "  --codecs LIST       Comma-separated codecs the entries pick from, e.g. COMPRESSION_LZ77,COMPRESSION_LZ11:3" << std::endl;
+    std::cout << "  --outer SPEC        Compression of the archive itself (default COMPRESSION_NONE)" << std::endl;
+    std::cout << "  --runs N            Run every phase N times and report the fastest (default 1)" << std::endl;
+    std::cout << "  --work DIR          Directory for generated files (default archivebench_work)" << std::endl;
+    std::cout << "  --generate-only     Write the .lst trees and stop" << std::endl;
+    std::cout << "  --keep              Keep generated files" << std::endl;
+    std::cout << "  --json              Print results as JSON" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string tool;
+    std::string work_dir = "archivebench_work";
+    std::vector<ArchiveShape> shapes;
+    std::vector<std::string> tool_args;
+    ArchiveShape custom;
+    bool has_custom = false;
+    bool generate_only = false;
+    bool keep = false;
+    bool json = false;
+    int runs = 1;
+    custom.m_name = "custom";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--") {
+            tool_args.assign(argv + i + 1, argv + argc);
+            break;
+        } else if (arg == "--tool" && i + 1 < argc) {
+            tool = argv[++i];
+        } else if (arg == "--work" && i + 1 < argc) {
+            work_dir = argv[++i];
+        } else if (arg == "--runs" && i + 1 < argc) {
+            runs = std::max(atoi(argv[++i]), 1);
+        } else if (arg == "--shape" && i + 1 < argc) {
+            ArchiveShape shape;
+            if (!GetPresetShape(argv[++i], shape)) {
+                std::cout << "Unknown shape " << argv[i] << "." << std::endl;
+                return 1;
+            }
+            shapes.push_back(shape);
+        } else if (arg == "--generate-only") {
+            generate_only = true;
+        } else if (arg == "--keep") {
+            keep = true;
+        } else if (arg == "--json") {
+            json = true;
+        } else if (i + 1 < argc && ParseShapeOption(custom, arg, argv[i + 1])) {
+            has_custom = true;
+            i++;
+        } else {
+            std::cout << "Invalid option " << arg << std::endl;
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (tool.empty() && !generate_only) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (has_custom) {
+        shapes.push_back(custom);
+    }
+    if (shapes.empty()) {
+        shapes.resize(2);
+        GetPresetShape("large", shapes[0]);
+        GetPresetShape("small", shapes[1]);
+    }
+    if (mkdir(work_dir.c_str(), 0777) != 0 && errno != EEXIST) {
+        std::cout << "Failed to create " << work_dir << "." << std::endl;
+        return 1;
+    }
+    bool failed = false;
+    int num_reported = 0;
+    if (json) {
+        std::cout << "{" << std::endl << "\t\"shapes\": [";
+    } else if (!generate_only) {
+        printf("%-10s %8s %12s %-10s %10s %10s %12s\n", "shape", "entries", "bytes", "phase", "seconds", "MB/s", "peak RSS KB");
+    }
+    for (size_t s = 0; s < shapes.size(); s++) {
+        const ArchiveShape &shape = shapes[s];
+        std::vector<PhaseResult> phases(4);
+        phases[0].m_name = "generate";
+        phases[1].m_name = "rebuild";
+        phases[2].m_name = "extract";
+        phases[3].m_name = "verify";
+        std::string list_name = work_dir + "/" + shape.m_name + ".lst";
+        std::string archive_name = work_dir + "/" + shape.m_name + ".bin";
+        std::string extract_name = shape.m_name + "_extracted";
+        uint64_t total_size;
+        double start = benchNow();
+        if (!GenerateTree(shape, work_dir, total_size)) {
+            return 1;
+        }
+        phases[0].m_seconds = benchNow() - start;
+        phases[0].m_bytes = total_size;
+        if (generate_only) {
+            std::cout << "Wrote " << list_name << " (" << shape.m_num_entries << " entries, " << total_size << " bytes)" << std::endl;
+            continue;
+        }
+        bool shape_ok = true;
+        for (int run = 0; run < runs && shape_ok; run++) {
+            PhaseResult rebuild, extract;
+            if (!RunTool(tool, tool_args, list_name, archive_name, rebuild)) {
+                std::cerr << "Rebuilding " << list_name << " failed." << std::endl;
+                shape_ok = false;
+            } else if (!RunTool(tool, tool_args, archive_name, work_dir + "/" + extract_name + ".lst", extract)) {
+                std::cerr << "Extracting " << archive_name << " failed." << std::endl;
+                shape_ok = false;
+            }
+            if (run == 0 || rebuild.m_seconds < phases[1].m_seconds) {
+                phases[1].m_seconds = rebuild.m_seconds;
+                phases[1].m_peak_rss_kb = rebuild.m_peak_rss_kb;
+            }
+            if (run == 0 || extract.m_seconds < phases[2].m_seconds) {
+                phases[2].m_seconds = extract.m_seconds;
+                phases[2].m_peak_rss_kb = extract.m_peak_rss_kb;
+            }
+        }
+        phases[1].m_bytes = phases[2].m_bytes = phases[3].m_bytes = total_size;
+        start = benchNow();
+        shape_ok = shape_ok && VerifyTree(shape, work_dir, extract_name);
+        phases[3].m_seconds = benchNow() - start;
+        if (shape_ok) {
+            struct stat archive_stat;
+            uint64_t archive_size = stat(archive_name.c_str(), &archive_stat) == 0 ? archive_stat.st_size : 0;
+            PrintShapeResult(shape, total_size, archive_size, phases, json, num_reported == 0);
+            num_reported++;
+        } else {
+            failed = true;
+        }
+        if (!keep) {
+            RemoveTree(work_dir + "/" + shape.m_name, shape.m_num_entries);
+            RemoveTree(work_dir + "/" + extract_name, shape.m_num_entries);
+            unlink(list_name.c_str());
+            unlink(archive_name.c_str());
+            unlink((work_dir + "/" + extract_name + ".lst").c_str());
+        }
+    }
+    if (json) {
+        std::cout << std::endl << "\t]" << std::endl << "}" << std::endl;
+    }
+    if (!keep) {
+        rmdir(work_dir.c_str());
+    }
+    return failed;
+}
@@ -0,0 +1,274 @@
+//Codec benchmark: times every compressor, decompressor, streaming decoder and getCompressionType
+//over a reproducible synthetic corpus, reporting throughput in MB/s and compression ratio. It also
+//checks that estimateCompressedSize never predicts a loss for data the codec does shrink.
+//
+//Build alongside the codecs, e.g.:
+//	cc -O2 -o codecbench bench/codecbench.c bench/corpus.c compression.c -lm
+//
+//Usage: codecbench [-l level] [-t seconds] [--sizes 4096,65536,...] [--json]
+//The corpus depends only on the sizes, so results from different versions are comparable.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../compression.h"
+#include "corpus.h"
+
+#define MAX_SIZES 16
+
+static const int codecs[] = {
+	COMPRESSION_LZ77,
+	COMPRESSION_LZ11,
+	COMPRESSION_HUFFMAN_4,
+	COMPRESSION_HUFFMAN_8,
+	COMPRESSION_LZ77_HEADER
+};
+
+//----- Timing
+
+typedef struct BENCHRESULT_ {
+	int compressedSize;
+	double compressMBs;
+	double decompressMBs;
+	double streamMBs;
+	double detectMBs;
+	int roundTrip; //decompressed data, whole and streamed, matched the input
+} BENCHRESULT;
+
+char *benchDecompress(int codec, char *buffer, int size, int *uncompressedSize) {
+	switch (codec) {
+		case COMPRESSION_LZ77:
+			return lz77decompress(buffer, size, (unsigned int *) uncompressedSize);
+		case COMPRESSION_LZ11:
+			return lz11decompress(buffer, size, uncompressedSize);
+		case COMPRESSION_HUFFMAN_4:
+		case COMPRESSION_HUFFMAN_8:
+			return huffmanDecompress((unsigned char *) buffer, size, uncompressedSize);
+		case COMPRESSION_LZ77_HEADER:
+			return lz77HeaderDecompress(buffer, size, uncompressedSize);
+	}
+	return NULL;
+}
+
+//decodes through a stream in STREAM_CHUNK pieces, as a reader of a file would, checking the output
+//against expected when it is given. Returns whether the data decoded to size bytes.
+#define STREAM_CHUNK 0x1000
+
+int benchStream(int codec, char *buffer, int size, const unsigned char *expected, int expectedSize) {
+	DECOMPRESSIONSTREAM stream;
+	char chunk[STREAM_CHUNK];
+	if (!decompressStreamInit(&stream, codec)) return 0;
+	int nFed = 0, nDecoded = 0;
+	while (1) {
+		int n = size - nFed < STREAM_CHUNK ? size - nFed : STREAM_CHUNK;
+		nFed += decompressStreamFeed(&stream, buffer + nFed, n);
+		int nDrained = decompressStreamDrain(&stream, chunk, STREAM_CHUNK);
+		if (nDrained < 0 || nDecoded + nDrained > expectedSize) return 0;
+		if (expected != NULL && memcmp(chunk, expected + nDecoded, nDrained) != 0) return 0;
+		nDecoded += nDrained;
+		if (nDrained == 0 && nFed == size) break;
+	}
+	return decompressStreamFinish(&stream) && nDecoded == expectedSize;
+}
+
+//repeats an operation until minTime has passed and returns the throughput over size bytes.
+#define BENCH_TIME(minTime, size, mbs, op) do {                \
+	int nRuns = 0;                                             \
+	double start = benchNow(), elapsed;                        \
+	do {                                                       \
+		op;                                                    \
+		nRuns++;                                               \
+		elapsed = benchNow() - start;                          \
+	} while (elapsed < (minTime));                             \
+	(mbs) = (double) (size) * nRuns / elapsed / 1000000.0;     \
+} while (0)
+
+int benchCodec(int codec, unsigned char *data, int size, int level, double minTime, BENCHRESULT *result) {
+	char *compressed = compress((char *) data, size, codec, &result->compressedSize, level);
+	if (compressed == NULL) return 0;
+
+	BENCH_TIME(minTime, size, result->compressMBs, {
+		int cs;
+		free(compress((char *) data, size, codec, &cs, level));
+	});
+
+	int uncompressedSize = 0;
+	char *decompressed = benchDecompress(codec, compressed, result->compressedSize, &uncompressedSize);
+	result->roundTrip = decompressed != NULL && uncompressedSize == size && memcmp(decompressed, data, size) == 0;
+	free(decompressed);
+	result->roundTrip &= benchStream(codec, compressed, result->compressedSize, data, size);
+
+	BENCH_TIME(minTime, size, result->decompressMBs, {
+		int us;
+		free(benchDecompress(codec, compressed, result->compressedSize, &us));
+	});
+
+	BENCH_TIME(minTime, size, result->streamMBs, {
+		benchStream(codec, compressed, result->compressedSize, NULL, size);
+	});
+
+	volatile int detected;
+	BENCH_TIME(minTime, size, result->detectMBs, {
+		detected = getCompressionType(compressed, result->compressedSize);
+	});
+	(void) detected;
+
+	free(compressed);
+	return 1;
+}
+
+//----- Estimate calibration
+
+//random bytes with about percent of them in length-byte repeats of data at most 4KB back: too few
+//repeats to stand out, but enough for the LZ codecs to shrink the data.
+void genRepeats(unsigned char *buffer, int size, BENCHRNG *rng, int percent, int length) {
+	//a repeat starts in place of a literal often enough that it covers percent of the bytes.
+	uint32_t chance = (uint32_t) (1000.0 * percent / (length * (100 - percent) + percent));
+	int pos = 0;
+	while (pos < size) {
+		if (pos >= 0x1000 && benchRandom(rng) % 1000 < chance) {
+			int src = pos - length - (int) (benchRandom(rng) % (0x1000 - length));
+			for (int i = 0; i < length && pos < size; i++) {
+				buffer[pos++] = buffer[src + i];
+			}
+		} else {
+			buffer[pos++] = benchRandom(rng);
+		}
+	}
+}
+
+//reports a predicted loss for data that compressed to compressedSize < size.
+int checkEstimate(int codec, unsigned char *data, int size, int compressedSize, const char *corpus) {
+	COMPRESSIONESTIMATE estimate;
+	estimateCompression((char *) data, size, &estimate);
+	int predicted = estimateCompressedSize(&estimate, size, codec);
+	if (predicted >= size && compressedSize < size) {
+		fprintf(stderr, "estimate predicted %d bytes for %s on %s/%d, which compressed to %d\n",
+			predicted, getCompressionTypeName(codec), corpus, size, compressedSize);
+		return 0;
+	}
+	return 1;
+}
+
+//runs the repeat mixes that sit right around the point where compressing starts to pay off.
+int calibrateEstimate(const int *codecs, int nCodecs, const int *sizes, int nSizes, int level) {
+	static const int percents[] = { 5, 10, 15, 20, 25, 40 };
+	static const int lengths[] = { 3, 4, 8, 20, 64 };
+	int ok = 1;
+	for (int s = 0; s < nSizes; s++) {
+		int size = sizes[s];
+		unsigned char *data = (unsigned char *) malloc(size);
+		for (int p = 0; p < (int) (sizeof(percents) / sizeof(percents[0])); p++) {
+			for (int l = 0; l < (int) (sizeof(lengths) / sizeof(lengths[0])); l++) {
+				BENCHRNG rng = { 0x9E3779B9u ^ (uint32_t) size ^ (uint32_t) (percents[p] << 16 | lengths[l]) };
+				genRepeats(data, size, &rng, percents[p], lengths[l]);
+				char corpus[32];
+				snprintf(corpus, sizeof(corpus), "repeats-%d%%x%d", percents[p], lengths[l]);
+				for (int k = 0; k < nCodecs; k++) {
+					int compressedSize;
+					char *compressed = compress((char *) data, size, codecs[k], &compressedSize, level);
+					if (compressed == NULL) continue;
+					free(compressed);
+					ok &= checkEstimate(codecs[k], data, size, compressedSize, corpus);
+				}
+			}
+		}
+		free(data);
+	}
+	return ok;
+}
+
+int parseSizes(const char *list, int *sizes) {
+	int nSizes = 0;
+	while (*list && nSizes < MAX_SIZES) {
+		char *end;
+		long size = strtol(list, &end, 10);
+		if (end == list || size <= 0 || size > 0xFFFFFF) return 0;
+		sizes[nSizes++] = size;
+		list = *end == ',' ? end + 1 : end;
+		if (*end != ',' && *end != '\0') return 0;
+	}
+	return nSizes;
+}
+
+int main(int argc, char **argv) {
+	int level = COMPRESSION_LEVEL_DEFAULT;
+	double minTime = 0.2;
+	int json = 0;
+	int sizes[MAX_SIZES] = { 4096, 65536, 1048576 };
+	int nSizes = 3;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+			level = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			minTime = atof(argv[++i]);
+		} else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+			nSizes = parseSizes(argv[++i], sizes);
+			if (nSizes == 0) {
+				fprintf(stderr, "Invalid size list %s\n", argv[i]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--json") == 0) {
+			json = 1;
+		} else {
+			fprintf(stderr, "Usage: %s [-l level] [-t seconds] [--sizes 4096,65536,...] [--json]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	int nCorpora = benchNumCorpora;
+	int nCodecs = sizeof(codecs) / sizeof(codecs[0]);
+	int failed = 0;
+	int first = 1;
+	if (json) {
+		printf("{\n\t\"level\": %d,\n\t\"results\": [", level);
+	} else {
+		printf("%-8s %9s %-24s %7s %12s %12s %12s %12s\n", "corpus", "size", "codec", "ratio", "comp MB/s", "decomp MB/s", "stream MB/s", "detect MB/s");
+	}
+	for (int c = 0; c < nCorpora; c++) {
+		for (int s = 0; s < nSizes; s++) {
+			int size = sizes[s];
+			unsigned char *data = (unsigned char *) malloc(size);
+			BENCHRNG rng = { 0x9E3779B9u ^ (uint32_t) size };
+			benchCorpora[c].generate(data, size, &rng);
+
+			for (int k = 0; k < nCodecs; k++) {
+				BENCHRESULT result;
+				const char *codecName = getCompressionTypeName(codecs[k]);
+				if (!benchCodec(codecs[k], data, size, level, minTime, &result)) {
+					fprintf(stderr, "%s failed on %s/%d\n", codecName, benchCorpora[c].name, size);
+					failed = 1;
+					continue;
+				}
+				if (!result.roundTrip) {
+					fprintf(stderr, "%s did not round-trip %s/%d\n", codecName, benchCorpora[c].name, size);
+					failed = 1;
+				}
+				if (!checkEstimate(codecs[k], data, size, result.compressedSize, benchCorpora[c].name)) {
+					failed = 1;
+				}
+				double ratio = (double) result.compressedSize / size;
+				if (json) {
+					printf("%s\n\t\t{ \"corpus\": \"%s\", \"size\": %d, \"codec\": \"%s\", \"compressedSize\": %d, \"ratio\": %.4f, "
+						"\"compressMBs\": %.2f, \"decompressMBs\": %.2f, \"streamMBs\": %.2f, \"detectMBs\": %.2f, \"roundTrip\": %s }",
+						first ? "" : ",", benchCorpora[c].name, size, codecName, result.compressedSize, ratio,
+						result.compressMBs, result.decompressMBs, result.streamMBs, result.detectMBs, result.roundTrip ? "true" : "false");
+					first = 0;
+				} else {
+					printf("%-8s %9d %-24s %7.4f %12.2f %12.2f %12.2f %12.2f\n", benchCorpora[c].name, size, codecName, ratio,
+						result.compressMBs, result.decompressMBs, result.streamMBs, result.detectMBs);
+				}
+				fflush(stdout);
+			}
+			free(data);
+		}
+	}
+	if (json) {
+		printf("\n\t]\n}\n");
+	}
+	if (!calibrateEstimate(codecs, nCodecs, sizes, nSizes, level)) {
+		failed = 1;
+	}
+	return failed;
+}
@@ -0,0 +1,130 @@
+#include <string.h>
+#include <time.h>
+
+#include "corpus.h"
+
+uint32_t benchRandom(BENCHRNG *rng) {
+	//xorshift32; fixed seeds keep the corpus identical across runs and versions.
+	uint32_t x = rng->state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	rng->state = x;
+	return x;
+}
+
+double benchNow(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//----- Corpus generators
+
+void genRandom(unsigned char *buffer, int size, BENCHRNG *rng) {
+	for (int i = 0; i < size; i++) {
+		buffer[i] = benchRandom(rng);
+	}
+}
+
+void genZeros(unsigned char *buffer, int size, BENCHRNG *rng) {
+	(void) rng; //the signature every generator in benchCorpora shares.
+	memset(buffer, 0, size);
+}
+
+void genText(unsigned char *buffer, int size, BENCHRNG *rng) {
+	static const char *words[] = {
+		"the", "of", "and", "to", "a", "in", "is", "you", "that", "it", "he", "was", "for", "on", "are",
+		"with", "as", "his", "they", "be", "at", "one", "have", "this", "from", "dice", "star", "coins",
+		"board", "player", "turn", "minigame", "item", "space", "bowser", "happening", "lucky", "bonus"
+	};
+	int nWords = sizeof(words) / sizeof(words[0]);
+	int pos = 0;
+	while (pos < size) {
+		//squaring the pick favours the first words, roughly like natural text.
+		uint32_t r = benchRandom(rng) % nWords;
+		const char *word = words[r * r / nWords];
+		for (int i = 0; word[i] && pos < size; i++) {
+			buffer[pos++] = word[i];
+		}
+		if (pos < size) {
+			uint32_t sep = benchRandom(rng) % 16;
+			buffer[pos++] = sep == 0 ? '\n' : (sep == 1 ? '.' : ' ');
+		}
+	}
+}
+
+void genTable(unsigned char *buffer, int size, BENCHRNG *rng) {
+	//16-byte records: an increasing id, a few small fields, a fixed-point value and padding.
+	for (int i = 0; i < size; i++) {
+		int record = i / 16;
+		int field = i % 16;
+		unsigned char value;
+		if (field < 4) {
+			value = (record >> (field * 8)) & 0xFF;
+		} else if (field < 8) {
+			value = benchRandom(rng) % 8;
+		} else if (field < 12) {
+			value = field == 10 ? (record * 3) & 0xFF : 0;
+		} else {
+			value = field == 12 ? 0xFF : 0;
+		}
+		buffer[i] = value;
+	}
+}
+
+void genAsset(unsigned char *buffer, int size, BENCHRNG *rng) {
+	//a mix of the data found in game archives: 4bpp tile graphics built from a small set of
+	//tiles, palettes, strings and tables, in chunks of varying length.
+	unsigned char tiles[8][32];
+	for (int t = 0; t < 8; t++) {
+		for (int i = 0; i < 32; i++) {
+			unsigned lo = benchRandom(rng) % 4, hi = benchRandom(rng) % 4;
+			tiles[t][i] = (hi << 4) | lo;
+		}
+	}
+	int pos = 0;
+	while (pos < size) {
+		int chunk = 512 + benchRandom(rng) % 3584;
+		if (chunk > size - pos) chunk = size - pos;
+		switch (benchRandom(rng) % 5) {
+			case 0:
+			case 1:
+				for (int i = 0; i < chunk; i += 32) {
+					int n = chunk - i < 32 ? chunk - i : 32;
+					memcpy(buffer + pos + i, tiles[benchRandom(rng) % 8], n);
+				}
+				break;
+			case 2:
+				for (int i = 0; i < chunk; i++) {
+					//15-bit colours, little-endian.
+					buffer[pos + i] = (i & 1) ? (benchRandom(rng) & 0x7F) : benchRandom(rng);
+				}
+				break;
+			case 3:
+				genText(buffer + pos, chunk, rng);
+				break;
+			default:
+				genTable(buffer + pos, chunk, rng);
+				break;
+		}
+		pos += chunk;
+	}
+}
+
+const BENCHCORPUS benchCorpora[] = {
+	{ "random", genRandom },
+	{ "zeros", genZeros },
+	{ "text", genText },
+	{ "table", genTable },
+	{ "asset", genAsset }
+};
+
+const int benchNumCorpora = sizeof(benchCorpora) / sizeof(benchCorpora[0]);
+
+const BENCHCORPUS *benchFindCorpus(const char *name) {
+	for (int i = 0; i < benchNumCorpora; i++) {
+		if (strcmp(benchCorpora[i].name, name) == 0) return &benchCorpora[i];
+	}
+	return NULL;
+}
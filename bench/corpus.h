@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+//Reproducible synthetic data shared by the benchmarks. Every generator is driven by a seeded
+//xorshift generator, so the same seed and size always give the same bytes.
+
+typedef struct BENCHRNG_ {
+	uint32_t state;
+} BENCHRNG;
+
+typedef struct BENCHCORPUS_ {
+	const char *name;
+	void (*generate) (unsigned char *buffer, int size, BENCHRNG *rng);
+} BENCHCORPUS;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint32_t benchRandom(BENCHRNG *rng);
+double benchNow(void);
+
+void genRandom(unsigned char *buffer, int size, BENCHRNG *rng);
+void genZeros(unsigned char *buffer, int size, BENCHRNG *rng);
+void genText(unsigned char *buffer, int size, BENCHRNG *rng);
+void genTable(unsigned char *buffer, int size, BENCHRNG *rng);
+void genAsset(unsigned char *buffer, int size, BENCHRNG *rng);
+
+//all corpora, in a fixed order: random, zeros, text, table, asset
+extern const BENCHCORPUS benchCorpora[];
+extern const int benchNumCorpora;
+
+//looks a corpus up by name, returning NULL if there is none
+const BENCHCORPUS *benchFindCorpus(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,10 +1,68 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <math.h>
 
 #include "compression.h"
 
-char *lz77decompress(char *buffer, int size, unsigned int *uncompressedSize){
+//decoders allocate this much past the end of their output so matches can be copied in whole words.
+#define LZ_COPY_SLACK 16
+
+//hot-path counters are kept per thread, so codecs running in parallel never share a cache line.
+//hot loops count into locals and add them once per call. Define COMPRESSION_NO_COUNTERS to compile them out.
+#ifndef COMPRESSION_NO_COUNTERS
+#if defined(_MSC_VER)
+static __declspec(thread) COMPRESSIONCOUNTERS counters;
+#else
+static _Thread_local COMPRESSIONCOUNTERS counters;
+#endif
+#define COUNTER_ADD(field, n) (counters.field += (n))
+#else
+#define COUNTER_ADD(field, n) ((void) (n))
+#endif
+
+//histogram bucket of a match length: bucket b holds lengths 2^b to 2^(b+1)-1.
+static inline int lzLengthBucket(int len) {
+	int bucket = 0;
+	while (len >>= 1) bucket++;
+	return bucket;
+}
+
+static inline void lzCopyMatch(unsigned char *dst, uint32_t offs, uint32_t len) {
+	//copy a back-reference of len bytes from offs bytes back. may write up to
+	//LZ_COPY_SLACK bytes past dst + len.
+	unsigned char *end = dst + len;
+	if (offs >= len && len >= 64) {
+		//source and destination don't overlap, so copy it all at once.
+		memcpy(dst, dst - offs, len);
+		return;
+	}
+	if (offs >= 16) {
+		do {
+			memcpy(dst, dst - offs, 16);
+			dst += 16;
+		} while (dst < end);
+		return;
+	}
+	if (offs < 8) {
+		//the source overlaps the first bytes written. copy those one at a time, after which the
+		//data repeats with a period of offs, so any multiple of offs is also a valid distance.
+		for (int i = 0; i < 8; i++) {
+			dst[i] = dst[i - (int) offs];
+		}
+		dst += 8;
+		uint32_t period = offs;
+		while (offs < 8) offs += period;
+	}
+	while (dst < end) {
+		memcpy(dst, dst - offs, 8);
+		dst += 8;
+	}
+}
+
+//the decoders set outOfMemory when they return NULL for want of memory rather than for bad data.
+static char *lz77Decode(char *buffer, int size, unsigned int *uncompressedSize, int *outOfMemory) {
 	//decompress the input buffer. 
 	//input is invalid if the size is less than 4.
 	if (size < 4) return NULL;
@@ -13,14 +71,21 @@ char *lz77decompress(char *buffer, int size, unsigned int *uncompressedSize){
 	uint32_t length = *(uint32_t *) (buffer + 1) & 0xFFFFFF;
 
 	//create a buffer for the decompressed buffer
-	char *result = (char *) malloc(length);
-	if (result == NULL) return NULL;
+	char *result = (char *) malloc(length + LZ_COPY_SLACK);
+	if (result == NULL) {
+		*outOfMemory = 1;
+		return NULL;
+	}
 	*uncompressedSize = length;
+	if (length == 0) return result;
 
-	//initialize variables
+	//initialize variables. every read is checked against the end of the input, and
+	//every back-reference against the start of the output; malformed data returns NULL.
 	uint32_t offset = 4;
 	uint32_t dstOffset = 0;
+	uint32_t nLiterals = 0, nMatches = 0;
 	while (1) {
+		if (offset >= (uint32_t) size) break;
 		uint8_t head = buffer[offset];
 		offset++;
 		//loop 8 times
@@ -29,33 +94,48 @@ char *lz77decompress(char *buffer, int size, unsigned int *uncompressedSize){
 			head <<= 1;
 
 			if (!flag) {
+				if (offset >= (uint32_t) size) goto invalid;
 				result[dstOffset] = buffer[offset];
 				dstOffset++, offset++;
-				if(dstOffset == length) return result;
+				nLiterals++;
+				if(dstOffset == length) goto done;
 			} else {
+				if (offset + 1 >= (uint32_t) size) goto invalid;
 				uint8_t high = buffer[offset++];
 				uint8_t low = buffer[offset++];
 
 				//length of uncompressed chunk and offset
 				uint32_t offs = (((high & 0xF) << 8) | low) + 1;
 				uint32_t len = (high >> 4) + 3;
-				for (uint32_t j = 0; j < len; j++) {
-					result[dstOffset] = result[dstOffset - offs];
-					dstOffset++;
-					if(dstOffset == length) return result;
-				}
+				if (dstOffset < offs) goto invalid;
+				if (len > length - dstOffset) len = length - dstOffset;
+				lzCopyMatch((unsigned char *) result + dstOffset, offs, len);
+				dstOffset += len;
+				nMatches++;
+				if(dstOffset == length) goto done;
 			}
 		}
 	}
+invalid:
+	free(result);
+	return NULL;
+done:
+	COUNTER_ADD(nDecodedLiterals, nLiterals);
+	COUNTER_ADD(nDecodedMatches, nMatches);
 	return result;
 }
 
+char *lz77decompress(char *buffer, int size, unsigned int *uncompressedSize) {
+	int outOfMemory = 0;
+	return lz77Decode(buffer, size, uncompressedSize, &outOfMemory);
+}
+
 char *lz77HeaderDecompress(char *buffer, int size, int *uncompressedSize) {
 	if (size < 8) return NULL;
-	return lz77decompress(buffer + 4, size - 4, uncompressedSize);
+	return lz77decompress(buffer + 4, size - 4, (unsigned int *) uncompressedSize);
 }
 
-char *lz11decompress(char *buffer, int size, int *uncompressedSize) {
+static char *lz11Decode(char *buffer, int size, int *uncompressedSize, int *outOfMemory) {
 	//decompress the input buffer. 
 	if (size < 4) return NULL;
 
@@ -63,14 +143,21 @@ char *lz11decompress(char *buffer, int size, int *uncompressedSize) {
 	uint32_t length = *(uint32_t *) (buffer) >> 8;
 
 	//create a buffer for the decompressed buffer
-	char *result = (char *) malloc(length);
-	if (result == NULL) return NULL;
+	char *result = (char *) malloc(length + LZ_COPY_SLACK);
+	if (result == NULL) {
+		*outOfMemory = 1;
+		return NULL;
+	}
 	*uncompressedSize = length;
+	if (length == 0) return result;
 
-	//initialize variables
+	//initialize variables. every read is checked against the end of the input, and
+	//every back-reference against the start of the output; malformed data returns NULL.
 	uint32_t offset = 4;
 	uint32_t dstOffset = 0;
+	uint32_t nLiterals = 0, nMatches = 0;
 	while (1) {
+		if (offset >= (uint32_t) size) break;
 		uint8_t head = buffer[offset];
 		offset++;
 
@@ -80,10 +167,13 @@ char *lz11decompress(char *buffer, int size, int *uncompressedSize) {
 			head <<= 1;
 
 			if (!flag) {
+				if (offset >= (uint32_t) size) goto invalid;
 				result[dstOffset] = buffer[offset];
 				dstOffset++, offset++;
-				if (dstOffset == length) return result;
+				nLiterals++;
+				if (dstOffset == length) goto done;
 			} else {
+				if (offset + 1 >= (uint32_t) size) goto invalid;
 				uint8_t high = buffer[offset++];
 				uint8_t low = buffer[offset++];
 				uint8_t low2, low3;
@@ -92,11 +182,13 @@ char *lz11decompress(char *buffer, int size, int *uncompressedSize) {
 				uint32_t len = 0, offs = 0;
 				switch (mode) {
 					case 0:
+						if (offset >= (uint32_t) size) goto invalid;
 						low2 = buffer[offset++];
 						len = ((high << 4) | (low >> 4)) + 0x11; //8-bit length +0x11
 						offs = (((low & 0xF) << 8) | low2) + 1; //12-bit offset
 						break;
 					case 1:
+						if (offset + 1 >= (uint32_t) size) goto invalid;
 						low2 = buffer[offset++];
 						low3 = buffer[offset++];
 						len = (((high & 0xF) << 12) | (low << 4) | (low2 >> 4)) + 0x111; //16-bit length +0x111
@@ -109,94 +201,855 @@ char *lz11decompress(char *buffer, int size, int *uncompressedSize) {
 				}
 
 				//write back
-				for (uint32_t j = 0; j < len; j++) {
-					result[dstOffset] = result[dstOffset - offs];
-					dstOffset++;
-					if (dstOffset == length) return result;
-				}
+				if (dstOffset < offs) goto invalid;
+				if (len > length - dstOffset) len = length - dstOffset;
+				lzCopyMatch((unsigned char *) result + dstOffset, offs, len);
+				dstOffset += len;
+				nMatches++;
+				if (dstOffset == length) goto done;
 			}
 		}
 	}
+invalid:
+	free(result);
+	return NULL;
+done:
+	COUNTER_ADD(nDecodedLiterals, nLiterals);
+	COUNTER_ADD(nDecodedMatches, nMatches);
 	return result;
 }
 
-char *huffmanDecompress(unsigned char *buffer, int size, int *uncompressedSize) {
+char *lz11decompress(char *buffer, int size, int *uncompressedSize) {
+	int outOfMemory = 0;
+	return lz11Decode(buffer, size, uncompressedSize, &outOfMemory);
+}
+
+#define HUFF_TABLE_BITS      10
+#define HUFF_TABLE_SIZE      (1 << HUFF_TABLE_BITS)
+#define HUFF_TABLE_MAX_SYMS  4
+
+typedef struct HUFFTABLEENTRY_ {
+	unsigned char nSyms; //symbols completed by this bit pattern; 0 if the first code is longer
+	unsigned char nBits; //bits used by those symbols, or bits walked to reach node
+	unsigned short node; //tree offset to continue from when nSyms is 0
+	unsigned char syms[HUFF_TABLE_MAX_SYMS];
+	unsigned char symEnd[HUFF_TABLE_MAX_SYMS]; //bits used up to and including each symbol
+} HUFFTABLEENTRY;
+
+//fill a table mapping the next HUFF_TABLE_BITS bits of input (starting at the root) to the symbols they
+//decode to. Walks the tree exactly like the bit-by-bit decoder, but never reads past the end of the buffer;
+//patterns that would leave it fall back to the bit-by-bit decoder from the root.
+void huffmanBuildTable(HUFFTABLEENTRY *table, unsigned char *treeBase, int treeLimit) {
+	for (int pattern = 0; pattern < HUFF_TABLE_SIZE; pattern++) {
+		HUFFTABLEENTRY *entry = table + pattern;
+		int trOffs = 1;
+		entry->nSyms = 0;
+		entry->nBits = 0;
+		entry->node = 1;
+		for (int i = 0; i < HUFF_TABLE_BITS; i++) {
+			int lr = (pattern >> (HUFF_TABLE_BITS - 1 - i)) & 1;
+			if (trOffs >= treeLimit) break;
+			unsigned char thisNode = treeBase[trOffs];
+			trOffs = (trOffs & ~1) + (((thisNode & 0x3F) + 1) << 1) + lr;
+			if (trOffs >= treeLimit) break;
+			if (thisNode & (0x80 >> lr)) { //reached a leaf node!
+				entry->symEnd[entry->nSyms] = i + 1;
+				entry->syms[entry->nSyms++] = treeBase[trOffs];
+				entry->nBits = i + 1;
+				trOffs = 1;
+				if (entry->nSyms == HUFF_TABLE_MAX_SYMS) break;
+			} else if (entry->nSyms == 0) {
+				entry->nBits = i + 1;
+				entry->node = trOffs;
+			}
+		}
+		if (entry->nSyms == 0 && entry->nBits < HUFF_TABLE_BITS) {
+			//left the buffer before finishing a symbol; decode this one bit by bit from the root.
+			entry->nBits = 0;
+			entry->node = 1;
+		}
+	}
+}
+
+//decode Huffman data, setting consumed to the number of bytes of input the bit stream actually
+//used, in whole words. Returns NULL if the tree leads outside of the buffer or the bit stream
+//runs past its end, or if the output can't be allocated, setting outOfMemory.
+char *huffmanDecode(unsigned char *buffer, int size, int *uncompressedSize, int *consumed, int *outOfMemory) {
 	if (size < 5) return NULL;
 
 	int outSize = (*(uint32_t *) buffer) >> 8;
 	char *out = (char *) malloc((outSize + 3) & ~3);
+	if (out == NULL) {
+		*outOfMemory = 1;
+		return NULL;
+	}
 	*uncompressedSize = outSize;
 
 	unsigned char *treeBase = buffer + 4;
+	int treeLimit = size - 4;
 	int symSize = *buffer & 0xF;
+	if (symSize == 0) symSize = 8; //0x20 is not a valid header; keep the loop below well-defined
 	int bufferFill = 0;
 	int bufferSize = 32 / symSize;
+	uint32_t symMask = (1 << symSize) - 1;
 	uint32_t outBuffer = 0;
 
-	int offs = ((*treeBase + 1) << 1) + 4;
-	int trOffs = 1;
+	HUFFTABLEENTRY table[HUFF_TABLE_SIZE];
+	huffmanBuildTable(table, treeBase, treeLimit);
+
+	int dataOffs = ((*treeBase + 1) << 1) + 4;
+	int offs = dataOffs;
+
+	//bits are read MSB first from little-endian words. Keep them left-aligned in a 64-bit buffer so a whole
+	//table index is always available; words past the end of the input read as zero.
+	uint64_t bitBuf = 0;
+	int bitCount = 0;
 
 	int nWritten = 0;
+	int unusedBits = 0;
 	while (nWritten < outSize) {
+		while (bitCount <= 32) {
+			uint32_t bits = 0;
+			if (offs + 4 <= size) bits = *(uint32_t *) (buffer + offs);
+			offs += 4;
+			bitBuf |= (uint64_t) bits << (32 - bitCount);
+			bitCount += 32;
+		}
 
-		uint32_t bits = *(uint32_t *) (buffer + offs);
-		offs += 4;
+		HUFFTABLEENTRY *entry = table + (bitBuf >> (64 - HUFF_TABLE_BITS));
+		int nSyms = entry->nSyms;
+		int trOffs = entry->node;
+		bitBuf <<= entry->nBits;
+		bitCount -= entry->nBits;
+
+		if (nSyms == 0) {
+			//code longer than the table: walk the rest of it one bit at a time.
+			while (1) {
+				if (bitCount == 0) {
+					uint32_t bits = 0;
+					if (offs + 4 <= size) bits = *(uint32_t *) (buffer + offs);
+					offs += 4;
+					bitBuf = (uint64_t) bits << 32;
+					bitCount = 32;
+				}
+				int lr = (int) (bitBuf >> 63);
+				if (trOffs >= treeLimit) goto invalid;
+				unsigned char thisNode = treeBase[trOffs];
+				trOffs = (trOffs & ~1) + (((thisNode & 0x3F) + 1) << 1) + lr;
+				bitBuf <<= 1;
+				bitCount--;
+				if (trOffs >= treeLimit) goto invalid;
+				if (thisNode & (0x80 >> lr)) break; //reached a leaf node!
+			}
+		}
 
-		for (int i = 0; i < 32; i++) {
-			int lr = (bits >> 31) & 1;
-			unsigned char thisNode = treeBase[trOffs];
-			int thisNodeOffs = ((thisNode & 0x3F) + 1) << 1; //add to current offset rounded down to get next element offset
+		for (int i = 0; i < (nSyms ? nSyms : 1); i++) {
+			uint32_t sym = nSyms ? entry->syms[i] : treeBase[trOffs];
+			outBuffer >>= symSize;
+			outBuffer |= (sym & symMask) << (32 - symSize);
+			bufferFill++;
+
+			if (bufferFill >= bufferSize) {
+				*(uint32_t *) (out + nWritten) = outBuffer;
+				nWritten += 4;
+				bufferFill = 0;
+				if (nWritten >= outSize) {
+					//the rest of this table entry decodes past the end of the data.
+					if (nSyms) unusedBits = entry->nBits - entry->symEnd[i];
+					break;
+				}
+			}
+		}
+	}
 
-			trOffs = (trOffs & ~1) + thisNodeOffs + lr;
+	//a decoder reads whole words, up to the one holding the last bit used.
+	int nBitsUsed = (offs - dataOffs) * 8 - bitCount - unusedBits;
+	*consumed = dataOffs + ((nBitsUsed + 31) >> 5) * 4;
+	if (*consumed > size) goto invalid;
+	return out;
 
-			if (thisNode & (0x80 >> lr)) { //reached a leaf node!
-				outBuffer >>= symSize;
-				outBuffer |= treeBase[trOffs] << (32 - symSize);
-				trOffs = 1;
-				bufferFill++;
+invalid:
+	free(out);
+	return NULL;
+}
 
-				if (bufferFill >= bufferSize) {
-					*(uint32_t *) (out + nWritten) = outBuffer;
-					nWritten += 4;
-					bufferFill = 0;
-				}
+char *huffmanDecompress(unsigned char *buffer, int size, int *uncompressedSize) {
+	int consumed, outOfMemory = 0;
+	return huffmanDecode(buffer, size, uncompressedSize, &consumed, &outOfMemory);
+}
+
+//----- Streaming decompression
+
+#define STREAM_HEADER    0 //reading the header
+#define STREAM_LZ        1 //reading LZ tokens
+#define STREAM_TREE      2 //reading the Huffman tree
+#define STREAM_HUFFMAN   3 //reading the Huffman bit stream
+
+int decompressStreamInit(DECOMPRESSIONSTREAM *stream, int compression) {
+	switch (compression) {
+		case COMPRESSION_LZ77:
+		case COMPRESSION_LZ11:
+		case COMPRESSION_LZ77_HEADER:
+		case COMPRESSION_HUFFMAN_4:
+		case COMPRESSION_HUFFMAN_8:
+			break;
+		default:
+			return 0;
+	}
+	stream->compression = compression;
+	stream->state = STREAM_HEADER;
+	stream->error = 0;
+	stream->length = 0;
+	stream->nDecoded = 0;
+	stream->inputStart = stream->inputEnd = 0;
+	stream->nFlags = 0;
+	stream->matchLen = 0;
+	stream->nTreeRead = 0;
+	stream->nBits = 0;
+	stream->node = 1;
+	stream->partial = 0;
+	stream->nPartial = 0;
+	return 1;
+}
+
+static int decompressStreamIsDone(const DECOMPRESSIONSTREAM *stream) {
+	return stream->state != STREAM_HEADER && stream->nDecoded == stream->length;
+}
+
+int decompressStreamFeed(DECOMPRESSIONSTREAM *stream, const char *input, int size) {
+	//whatever follows the end of the data is padding.
+	if (decompressStreamIsDone(stream) || stream->error) return size;
+
+	//move what is left to the front to make room.
+	int nLeft = stream->inputEnd - stream->inputStart;
+	memmove(stream->input, stream->input + stream->inputStart, nLeft);
+	stream->inputStart = 0;
+	stream->inputEnd = nLeft;
+	int nTaken = DECOMPRESSION_STREAM_INPUT - nLeft;
+	if (nTaken > size) nTaken = size;
+	memcpy(stream->input + nLeft, input, nTaken);
+	stream->inputEnd += nTaken;
+	return nTaken;
+}
+
+static int decompressStreamHeader(DECOMPRESSIONSTREAM *stream) {
+	int headerSize = stream->compression == COMPRESSION_LZ77_HEADER ? 8 : 4;
+	if (stream->inputEnd - stream->inputStart < headerSize) return 0;
+	unsigned char *header = stream->input + stream->inputStart + headerSize - 4;
+	stream->inputStart += headerSize;
+	stream->length = header[1] | (header[2] << 8) | (header[3] << 16);
+	if (stream->compression == COMPRESSION_HUFFMAN_4 || stream->compression == COMPRESSION_HUFFMAN_8) {
+		//the header tells which of the two it is.
+		stream->symSize = header[0] & 0xF;
+		if (stream->symSize != 4 && stream->symSize != 8) stream->error = 1;
+		stream->state = STREAM_TREE;
+	} else {
+		stream->state = STREAM_LZ;
+	}
+	return 1;
+}
+
+static inline void decompressStreamPut(DECOMPRESSIONSTREAM *stream, char *output, int *n, unsigned char b) {
+	output[(*n)++] = b;
+	stream->window[stream->nDecoded & (DECOMPRESSION_STREAM_WINDOW - 1)] = b;
+	stream->nDecoded++;
+}
+
+//decode LZ tokens until the output is full or a whole token isn't available.
+static void decompressStreamLz(DECOMPRESSIONSTREAM *stream, char *output, int size, int *n) {
+	unsigned char *in = stream->input;
+	uint32_t nLiterals = 0, nMatches = 0;
+	while (*n < size && stream->nDecoded < stream->length) {
+		if (stream->matchLen > 0) {
+			//the window is written as the match is copied, so overlapping matches come out right.
+			uint32_t src = stream->nDecoded - stream->matchOffs;
+			unsigned char b = stream->window[src & (DECOMPRESSION_STREAM_WINDOW - 1)];
+			decompressStreamPut(stream, output, n, b);
+			stream->matchLen--;
+			continue;
+		}
+		int nAvail = stream->inputEnd - stream->inputStart;
+		if (stream->nFlags == 0) {
+			if (nAvail < 1) break;
+			stream->flags = in[stream->inputStart++];
+			stream->nFlags = 8;
+			continue;
+		}
+
+		if (!(stream->flags & 0x80)) {
+			if (nAvail < 1) break;
+			decompressStreamPut(stream, output, n, in[stream->inputStart++]);
+			nLiterals++;
+		} else {
+			if (nAvail < 2) break;
+			unsigned char *token = in + stream->inputStart;
+			uint32_t len, offs;
+			int tokenSize = 2;
+			if (stream->compression != COMPRESSION_LZ11) {
+				len = (token[0] >> 4) + 3;
+				offs = (((token[0] & 0xF) << 8) | token[1]) + 1;
+			} else if ((token[0] >> 4) == 0) {
+				tokenSize = 3;
+				if (nAvail < tokenSize) break;
+				len = ((token[0] << 4) | (token[1] >> 4)) + 0x11; //8-bit length +0x11
+				offs = (((token[1] & 0xF) << 8) | token[2]) + 1;
+			} else if ((token[0] >> 4) == 1) {
+				tokenSize = 4;
+				if (nAvail < tokenSize) break;
+				len = (((token[0] & 0xF) << 12) | (token[1] << 4) | (token[2] >> 4)) + 0x111; //16-bit length +0x111
+				offs = (((token[2] & 0xF) << 8) | token[3]) + 1;
+			} else {
+				len = (token[0] >> 4) + 1;
+				offs = (((token[0] & 0xF) << 8) | token[1]) + 1;
 			}
-			if (nWritten >= outSize) return out;
-			bits <<= 1; //next bit
+			if (offs > stream->nDecoded) {
+				stream->error = 1;
+				break;
+			}
+			if (len > stream->length - stream->nDecoded) len = stream->length - stream->nDecoded;
+			stream->inputStart += tokenSize;
+			stream->matchOffs = offs;
+			stream->matchLen = len;
+			nMatches++;
 		}
+		stream->flags <<= 1;
+		stream->nFlags--;
 	}
+	COUNTER_ADD(nDecodedLiterals, nLiterals);
+	COUNTER_ADD(nDecodedMatches, nMatches);
+}
 
-	return out;
+static void decompressStreamTree(DECOMPRESSIONSTREAM *stream) {
+	unsigned char *in = stream->input;
+	if (stream->nTreeRead == 0) {
+		if (stream->inputStart == stream->inputEnd) return;
+		stream->treeSize = (in[stream->inputStart] + 1) << 1;
+	}
+	int nWanted = stream->treeSize - stream->nTreeRead;
+	int nAvail = stream->inputEnd - stream->inputStart;
+	if (nWanted > nAvail) nWanted = nAvail;
+	memcpy(stream->tree + stream->nTreeRead, in + stream->inputStart, nWanted);
+	stream->nTreeRead += nWanted;
+	stream->inputStart += nWanted;
+	if (stream->nTreeRead == stream->treeSize) stream->state = STREAM_HUFFMAN;
 }
 
-int compareMemory(char *b1, char *b2, int nMax, int nAbsoluteMax) {
-	int nSame = 0;
-	if (nMax > nAbsoluteMax) nMax = nAbsoluteMax;
-	//count up to nMax. If all match, count 0x12-nMax bytes. The b1 just starts over.
-	for (int i = 0; i < nMax; i++) {
-		if (*(b1++) == *(b2++)) nSame++;
-		else break;
+//walk the tree one bit at a time, picking up where the last call stopped, until the output is
+//full or the next word of the bit stream hasn't been fed yet.
+static void decompressStreamHuffman(DECOMPRESSIONSTREAM *stream, char *output, int size, int *n) {
+	unsigned char *in = stream->input;
+	unsigned char *tree = stream->tree;
+	int node = stream->node;
+	while (*n < size && stream->nDecoded < stream->length) {
+		if (stream->nBits == 0) {
+			if (stream->inputEnd - stream->inputStart < 4) break;
+			unsigned char *word = in + stream->inputStart;
+			stream->bits = word[0] | (word[1] << 8) | (word[2] << 16) | ((uint32_t) word[3] << 24);
+			stream->nBits = 32;
+			stream->inputStart += 4;
+		}
+		int lr = stream->bits >> 31;
+		stream->bits <<= 1;
+		stream->nBits--;
+		unsigned char thisNode = tree[node];
+		node = (node & ~1) + (((thisNode & 0x3F) + 1) << 1) + lr;
+		if (node >= stream->treeSize) {
+			stream->error = 1;
+			break;
+		}
+		if (!(thisNode & (0x80 >> lr))) continue;
+
+		//reached a leaf node! Nibbles fill a byte from the low end.
+		unsigned char sym = tree[node];
+		node = 1;
+		if (stream->symSize == 8) {
+			decompressStreamPut(stream, output, n, sym);
+		} else {
+			stream->partial |= (sym & 0xF) << (4 * stream->nPartial);
+			if (++stream->nPartial == 2) {
+				decompressStreamPut(stream, output, n, stream->partial);
+				stream->partial = 0;
+				stream->nPartial = 0;
+			}
+		}
 	}
-	if (nSame == nMax) {
-		b1 -= nMax;
-		for (int i = 0; i < nAbsoluteMax - nMax; i++) {
-			if (*(b1++) == *(b2++)) nSame++;
-			else break;
+	stream->node = node;
+}
+
+int decompressStreamDrain(DECOMPRESSIONSTREAM *stream, char *output, int size) {
+	int n = 0;
+	while (!stream->error && !decompressStreamIsDone(stream) && n < size) {
+		int state = stream->state;
+		int inputStart = stream->inputStart;
+		int nDecoded = n;
+		switch (state) {
+			case STREAM_HEADER:
+				decompressStreamHeader(stream);
+				break;
+			case STREAM_LZ:
+				decompressStreamLz(stream, output, size, &n);
+				break;
+			case STREAM_TREE:
+				decompressStreamTree(stream);
+				break;
+			case STREAM_HUFFMAN:
+				decompressStreamHuffman(stream, output, size, &n);
+				break;
 		}
+		//stop once a pass gets nowhere: it is waiting on input.
+		if (stream->state == state && stream->inputStart == inputStart && n == nDecoded) break;
+	}
+	return stream->error ? -1 : n;
+}
+
+int decompressStreamGetSize(const DECOMPRESSIONSTREAM *stream) {
+	return stream->state == STREAM_HEADER ? -1 : (int) stream->length;
+}
+
+int decompressStreamFinish(DECOMPRESSIONSTREAM *stream) {
+	return !stream->error && decompressStreamIsDone(stream);
+}
+
+#define LZ_WINDOW_SIZE   0x1000
+#define LZ_WINDOW_MASK   (LZ_WINDOW_SIZE - 1)
+#define LZ_HASH_BITS     14
+#define LZ_HASH_SIZE     (1 << LZ_HASH_BITS)
+#define LZ_NIL           (-1)
+
+typedef struct LZHASHCHAIN_ {
+	int head[LZ_HASH_SIZE]; //most recent position for each 3-byte prefix hash
+	int prev[LZ_WINDOW_SIZE]; //previous position with the same hash, indexed by position within the window
+	int nInserted; //positions below this have been added to the chains
+	int maxDepth; //candidates to check per search
+} LZHASHCHAIN;
+
+unsigned int lzHash3(unsigned char *p) {
+	uint32_t v = (p[0] << 16) | (p[1] << 8) | p[2];
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+void lzHashChainInit(LZHASHCHAIN *chain, int maxDepth) {
+	memset(chain->head, 0xFF, sizeof(chain->head)); //all LZ_NIL
+	chain->nInserted = 0;
+	chain->maxDepth = maxDepth;
+}
+
+//add every position up to (but not including) pos to the hash chains.
+void lzHashChainInsert(LZHASHCHAIN *chain, unsigned char *buffer, int size, int pos) {
+	//a position needs 3 bytes to be hashed; positions near the end can never start a match anyway.
+	if (pos > size - 2) pos = size - 2;
+	while (chain->nInserted < pos) {
+		int i = chain->nInserted++;
+		unsigned int h = lzHash3(buffer + i);
+		chain->prev[i & LZ_WINDOW_MASK] = chain->head[h];
+		chain->head[h] = i;
+	}
+}
+
+//count matching bytes between pos and pos - dist, allowing the match to overlap itself.
+int lzMatchLength(unsigned char *buffer, int pos, int dist, int maxLen) {
+	unsigned char *src = buffer + pos - dist;
+	unsigned char *dst = buffer + pos;
+	int n = 0;
+	while (n < maxLen && src[n] == dst[n]) n++;
+	return n;
+}
+
+//find the longest match for the data at pos, walking the hash chain from the nearest candidate outwards.
+//displacements are limited to 2..0xFFF and the nearest of equally long matches wins, so with an unlimited
+//depth this finds exactly the matches the old exhaustive window scan did. Returns 0 if there is no match
+//of at least 3 bytes.
+int lzHashChainFind(LZHASHCHAIN *chain, unsigned char *buffer, int size, int pos, int maxLen, int *dist) {
+	int nBytesLeft = size - pos;
+	if (maxLen > nBytesLeft) maxLen = nBytesLeft;
+	if (maxLen < 3) return 0;
+	lzHashChainInsert(chain, buffer, size, pos);
+
+	int maxDist = LZ_WINDOW_SIZE - 1;
+	if (maxDist > pos - 1) maxDist = pos - 1;
+
+	int biggestRun = 0;
+	int nProbed = 0, nCompared = 0;
+	int candidate = chain->head[lzHash3(buffer + pos)];
+	for (int depth = 0; candidate != LZ_NIL && depth < chain->maxDepth; depth++) {
+		int j = pos - candidate;
+		if (j > maxDist) break;
+		nProbed++;
+		nCompared++;
+		//cheap reject: a longer match has to agree on the byte that would extend it.
+		if (j >= 2 && buffer[candidate + biggestRun] == buffer[pos + biggestRun]) {
+			int nMatched = lzMatchLength(buffer, pos, j, maxLen);
+			nCompared += nMatched;
+			if (nMatched > biggestRun) {
+				biggestRun = nMatched;
+				*dist = j;
+				if (biggestRun == maxLen) break;
+			}
+		}
+		candidate = chain->prev[candidate & LZ_WINDOW_MASK];
+	}
+	COUNTER_ADD(nSearches, 1);
+	COUNTER_ADD(nCandidates, nProbed);
+	COUNTER_ADD(nBytesCompared, nCompared);
+	return biggestRun >= 3 ? biggestRun : 0;
+}
+
+typedef struct LZBINTREE_ {
+	int head[LZ_HASH_SIZE]; //root of the tree for each 3-byte prefix hash
+	int son[LZ_WINDOW_SIZE * 2]; //smaller and larger child of each position within the window
+	int nInserted; //positions below this have been added to the trees
+	int maxDepth; //nodes to visit per insertion or search
+	int niceLength; //matches this long are taken without looking for longer ones
+} LZBINTREE;
+
+void lzBinTreeInit(LZBINTREE *tree, int maxDepth, int niceLength) {
+	memset(tree->head, 0xFF, sizeof(tree->head)); //all LZ_NIL
+	tree->nInserted = 0;
+	tree->maxDepth = maxDepth;
+	tree->niceLength = niceLength;
+}
+
+//insert position pos as the new root of its tree. Older positions are split into the smaller and larger
+//subtrees of the new root as it descends, and positions outside the window simply fall off.
+void lzBinTreeInsertPosition(LZBINTREE *tree, unsigned char *buffer, int size, int pos) {
+	unsigned int h = lzHash3(buffer + pos);
+	int candidate = tree->head[h];
+	tree->head[h] = pos;
+
+	int *smaller = &tree->son[(pos & LZ_WINDOW_MASK) * 2];
+	int *larger = &tree->son[(pos & LZ_WINDOW_MASK) * 2 + 1];
+	int lenSmaller = 0, lenLarger = 0;
+	int lenLimit = size - pos;
+	if (lenLimit > tree->niceLength) lenLimit = tree->niceLength;
+	unsigned char *cur = buffer + pos;
+	int nProbed = 0, nCompared = 0;
+
+	for (int depth = 0; ; depth++) {
+		if (candidate == LZ_NIL || depth == tree->maxDepth || pos - candidate >= LZ_WINDOW_SIZE) {
+			*smaller = *larger = LZ_NIL;
+			break;
+		}
+		int *pair = &tree->son[(candidate & LZ_WINDOW_MASK) * 2];
+		unsigned char *pb = buffer + candidate;
+		//both bounding subtrees already share this many bytes with cur.
+		int len = lenSmaller < lenLarger ? lenSmaller : lenLarger;
+		int lenStart = len;
+		while (len < lenLimit && pb[len] == cur[len]) len++;
+		nProbed++;
+		nCompared += len - lenStart + 1;
+		if (len == lenLimit) {
+			//candidate is equal as far as we care; pos takes over its children.
+			*smaller = pair[0];
+			*larger = pair[1];
+			break;
+		}
+		if (pb[len] < cur[len]) {
+			*smaller = candidate;
+			smaller = &pair[1];
+			candidate = *smaller;
+			lenSmaller = len;
+		} else {
+			*larger = candidate;
+			larger = &pair[0];
+			candidate = *larger;
+			lenLarger = len;
+		}
+	}
+	COUNTER_ADD(nCandidates, nProbed);
+	COUNTER_ADD(nBytesCompared, nCompared);
+}
+
+//add every position up to (but not including) pos to the trees.
+void lzBinTreeInsert(LZBINTREE *tree, unsigned char *buffer, int size, int pos) {
+	if (pos > size - 2) pos = size - 2;
+	while (tree->nInserted < pos) {
+		lzBinTreeInsertPosition(tree, buffer, size, tree->nInserted++);
 	}
-	return nSame;
 }
 
-char *lz77compress(char *buffer, int size, unsigned int *compressedSize){
-	int compressedMaxSize = 4 + 9 * ((size + 7) >> 3);
+//find the longest match for the data at pos. The trees only ever hold positions at least 2 bytes back, so
+//the search never has to modify them. Matches that reach the nice length are extended directly up to
+//maxLen, which keeps long runs linear. Returns 0 if there is no match of at least 3 bytes.
+int lzBinTreeFind(LZBINTREE *tree, unsigned char *buffer, int size, int pos, int maxLen, int *dist) {
+	int nBytesLeft = size - pos;
+	if (maxLen > nBytesLeft) maxLen = nBytesLeft;
+	if (maxLen < 3) return 0;
+	lzBinTreeInsert(tree, buffer, size, pos - 1);
+
+	int maxDist = LZ_WINDOW_SIZE - 1;
+	if (maxDist > pos - 1) maxDist = pos - 1;
+	int lenLimit = maxLen;
+	if (lenLimit > tree->niceLength) lenLimit = tree->niceLength;
+	unsigned char *cur = buffer + pos;
+
+	int biggestRun = 0;
+	int lenSmaller = 0, lenLarger = 0;
+	int nProbed = 0, nCompared = 0;
+	int candidate = tree->head[lzHash3(cur)];
+	for (int depth = 0; candidate != LZ_NIL && depth < tree->maxDepth; depth++) {
+		int j = pos - candidate;
+		if (j > maxDist) break;
+		int *pair = &tree->son[(candidate & LZ_WINDOW_MASK) * 2];
+		unsigned char *pb = buffer + candidate;
+		int len = lenSmaller < lenLarger ? lenSmaller : lenLarger;
+		int lenStart = len;
+		while (len < lenLimit && pb[len] == cur[len]) len++;
+		nProbed++;
+		nCompared += len - lenStart + 1;
+		if (len > biggestRun) {
+			biggestRun = len;
+			*dist = j;
+		}
+		if (len == lenLimit) break;
+		if (pb[len] < cur[len]) {
+			candidate = pair[1];
+			lenSmaller = len;
+		} else {
+			candidate = pair[0];
+			lenLarger = len;
+		}
+	}
+	if (biggestRun == tree->niceLength && maxLen > biggestRun) {
+		biggestRun = lzMatchLength(buffer, pos, *dist, maxLen);
+		nCompared += biggestRun - tree->niceLength + 1;
+	}
+	COUNTER_ADD(nSearches, 1);
+	COUNTER_ADD(nCandidates, nProbed);
+	COUNTER_ADD(nBytesCompared, nCompared);
+	return biggestRun >= 3 ? biggestRun : 0;
+}
+
+//a match never takes more bytes than it covers, so the output is at most the header, every byte
+//as a literal, a flag byte per 8 tokens and zeros filling out the last group.
+#define LZ_MAX_COMPRESSED_SIZE(n)    (4 + (n) + (((n) + 7) >> 3) + 7)
+//LZ11 data is also padded to a multiple of 4 bytes.
+#define LZ11_MAX_COMPRESSED_SIZE(n)  (LZ_MAX_COMPRESSED_SIZE(n) + 3)
+
+#define LZ77_MAX_LENGTH     0x12
+#define LZ11_MAX_LENGTH     (0xFFFF + 0x111)
+#define LZ_OPT_BLOCK_SIZE   0x10000
+#define LZ_OPT_MAX_RELAX    0x110
+
+typedef struct LZPARSER_ {
+	unsigned char *buffer;
+	int size;
+	int pos; //start of the next token
+	int level;
+	int maxLen;
+	int niceLength; //matches this long are taken as they are, without trying to parse around them
+	int (*matchBits)(int len); //size of a match token for the optimal parser, excluding its flag bit
+	LZHASHCHAIN *chain; //match finder for LZ77
+	LZBINTREE *tree; //match finder for LZ11
+	int hasNext, nextLen, nextDist; //lazy matching: the match already found at pos
+	int planStart, planEnd; //optimal parsing: range of positions covered by the current plan
+	int *planLen, *planDist;
+	unsigned int *planBits;
+	int *planFrom;
+} LZPARSER;
+
+int lz77MatchBits(int len) {
+	(void) len; //every LZ77 match takes 2 bytes; len is there to fit the matchBits signature.
+	return 16;
+}
+
+int lz11MatchBits(int len) {
+	if (len <= 0x10) return 16;
+	if (len <= 0xFF + 0x11) return 24;
+	return 32;
+}
+
+int lzParserFind(LZPARSER *parser, int pos, int maxLen, int *dist) {
+	if (parser->chain) return lzHashChainFind(parser->chain, parser->buffer, parser->size, pos, maxLen, dist);
+	return lzBinTreeFind(parser->tree, parser->buffer, parser->size, pos, maxLen, dist);
+}
+
+//set up a parser for LZ77 (useTree = 0) or LZ11 (useTree = 1) at the given level. Returns 0 when out of memory.
+int lzParserInit(LZPARSER *parser, unsigned char *buffer, int size, int level, int useTree) {
+	memset(parser, 0, sizeof(LZPARSER));
+	parser->buffer = buffer;
+	parser->size = size;
+	parser->level = level;
+	if (useTree) {
+		parser->maxLen = LZ11_MAX_LENGTH;
+		parser->matchBits = lz11MatchBits;
+		parser->tree = (LZBINTREE *) malloc(sizeof(LZBINTREE));
+		if (parser->tree == NULL) return 0;
+		if (level == COMPRESSION_LEVEL_FAST) lzBinTreeInit(parser->tree, 0x10, 0x40);
+		else lzBinTreeInit(parser->tree, 0x100, 0x111);
+		parser->niceLength = parser->tree->niceLength;
+	} else {
+		parser->maxLen = LZ77_MAX_LENGTH;
+		parser->matchBits = lz77MatchBits;
+		parser->chain = (LZHASHCHAIN *) malloc(sizeof(LZHASHCHAIN));
+		if (parser->chain == NULL) return 0;
+		if (level == COMPRESSION_LEVEL_FAST) lzHashChainInit(parser->chain, 0x10);
+		else lzHashChainInit(parser->chain, LZ_WINDOW_SIZE);
+		parser->niceLength = parser->maxLen;
+	}
+	if (level == COMPRESSION_LEVEL_OPTIMAL) {
+		parser->planLen = (int *) malloc(LZ_OPT_BLOCK_SIZE * sizeof(int));
+		parser->planDist = (int *) malloc(LZ_OPT_BLOCK_SIZE * sizeof(int));
+		parser->planBits = (unsigned int *) malloc((LZ_OPT_BLOCK_SIZE + 1) * sizeof(unsigned int));
+		parser->planFrom = (int *) malloc((LZ_OPT_BLOCK_SIZE + 1) * sizeof(int));
+		if (!parser->planLen || !parser->planDist || !parser->planBits || !parser->planFrom) return 0;
+	}
+	return 1;
+}
+
+void lzParserFree(LZPARSER *parser) {
+	free(parser->chain);
+	free(parser->tree);
+	free(parser->planLen);
+	free(parser->planDist);
+	free(parser->planBits);
+	free(parser->planFrom);
+}
+
+//plan the tokens for the next block with a shortest-path search over bit costs. Offsets have a fixed
+//size in both formats, so the longest match at each position is all the search needs: any shorter length
+//at the same distance is also a valid match.
+void lzParserPlan(LZPARSER *parser) {
+	int start = parser->pos;
+	int end = start + LZ_OPT_BLOCK_SIZE;
+	if (end > parser->size) end = parser->size;
+	int n = end - start;
+	int *len = parser->planLen;
+	int *dist = parser->planDist;
+	unsigned int *bits = parser->planBits;
+	int *from = parser->planFrom;
+
+	//gather the longest match at every position. Inside a match of nice length or more, the same distance
+	//keeps matching, so reuse it instead of searching (and extending) again at every byte of a long run.
+	int niceLength = parser->niceLength;
+	for (int i = 0; i < n; i++) {
+		if (i > 0 && len[i - 1] > niceLength) {
+			len[i] = len[i - 1] - 1;
+			dist[i] = dist[i - 1];
+			continue;
+		}
+		len[i] = lzParserFind(parser, start + i, parser->maxLen, &dist[i]);
+	}
+
+	bits[0] = 0;
+	for (int i = 1; i <= n; i++) bits[i] = 0xFFFFFFFF;
+	for (int i = 0; i < n; i++) {
+		//literal: flag bit plus the byte itself.
+		if (bits[i] + 9 < bits[i + 1]) {
+			bits[i + 1] = bits[i] + 9;
+			from[i + 1] = 1;
+		}
+		//matches may run past the end of the block, but the search stops there.
+		int fullLen = len[i];
+		if (fullLen > n - i) fullLen = n - i;
+		if (fullLen < 3) continue;
+		int maxRelax = fullLen;
+		if (maxRelax > LZ_OPT_MAX_RELAX) maxRelax = LZ_OPT_MAX_RELAX;
+		if (len[i] > niceLength) maxRelax = 2; //long enough; only try the full length below
+		for (int l = 3; l <= maxRelax; l++) {
+			unsigned int cost = bits[i] + 1 + parser->matchBits(l);
+			if (cost < bits[i + l]) {
+				bits[i + l] = cost;
+				from[i + l] = l;
+			}
+		}
+		if (fullLen > maxRelax) {
+			unsigned int cost = bits[i] + 1 + parser->matchBits(fullLen);
+			if (cost < bits[i + fullLen]) {
+				bits[i + fullLen] = cost;
+				from[i + fullLen] = fullLen;
+			}
+		}
+	}
+
+	//walk back from the end of the block, leaving the chosen length at the start of each token. A match
+	//that was cut off by the end of the block is allowed to run on, so the next block starts after it.
+	for (int i = n; i > 0; ) {
+		int l = from[i];
+		i -= l;
+		if (i + l == n && l >= 3 && len[i] > l) {
+			l = len[i];
+			end = start + i + l;
+		}
+		len[i] = l == 1 ? 0 : l;
+	}
+	parser->planStart = start;
+	parser->planEnd = end;
+}
+
+//get the next token. Returns the match length and stores its displacement in *dist, or returns 0 for a literal.
+int lzParserNext(LZPARSER *parser, int *dist) {
+	int pos = parser->pos;
+	int len;
+	if (parser->level == COMPRESSION_LEVEL_OPTIMAL) {
+		if (pos >= parser->planEnd) lzParserPlan(parser);
+		len = parser->planLen[pos - parser->planStart];
+		*dist = parser->planDist[pos - parser->planStart];
+	} else if (parser->hasNext) {
+		len = parser->nextLen;
+		*dist = parser->nextDist;
+		parser->hasNext = 0;
+	} else {
+		len = lzParserFind(parser, pos, parser->maxLen, dist);
+	}
+
+	//lazy matching: if the next position starts a longer match, emit a literal and take that one instead when
+	//it is cheaper than this match plus covering the extra bytes afterwards (assumed to be one more token).
+	if (parser->level == COMPRESSION_LEVEL_LAZY && len >= 3 && len < parser->niceLength) {
+		int nextDist;
+		int nextLen = lzParserFind(parser, pos + 1, parser->maxLen, &nextDist);
+		if (nextLen > len) {
+			int extra = nextLen + 1 - len;
+			int greedyBits = 1 + parser->matchBits(len) + (extra < 3 ? extra * 9 : 1 + parser->matchBits(extra));
+			int lazyBits = 9 + 1 + parser->matchBits(nextLen);
+			if (lazyBits < greedyBits) {
+				parser->hasNext = 1;
+				parser->nextLen = nextLen;
+				parser->nextDist = nextDist;
+				len = 0;
+			}
+		}
+	}
+	parser->pos += len >= 3 ? len : 1;
+	if (len >= 3) {
+		COUNTER_ADD(nMatches, 1);
+		COUNTER_ADD(matchLengths[lzLengthBucket(len)], 1);
+		return len;
+	}
+	COUNTER_ADD(nLiterals, 1);
+	return 0;
+}
+
+//the LZ compressors poll their bound once every this many flag groups.
+#define LZ_BOUND_INTERVAL 256
+
+static int compressionExceedsBound(const COMPRESSIONBOUND *bound, int nSize) {
+	return bound != NULL && nSize > bound->getMaxSize(bound->param);
+}
+
+static char *lz77compressBounded(char *buffer, int size, unsigned int *compressedSize, int level, const COMPRESSIONBOUND *bound) {
+	int compressedMaxSize = LZ_MAX_COMPRESSED_SIZE(size);
 	char *compressed = (char *) malloc(compressedMaxSize);
+	LZPARSER parser;
+	if (!lzParserInit(&parser, (unsigned char *) buffer, size, level, 0) || compressed == NULL) {
+		lzParserFree(&parser);
+		free(compressed);
+		return NULL;
+	}
 	char *compressedBase = compressed;
 	*(unsigned *) compressed = size << 8;
 	*compressed = 0x10;
 	int nProcessedBytes = 0;
 	int nSize = 4;
+	int nGroups = 0;
 	compressed += 4;
-	while (1) {
+	while (nProcessedBytes < size) {
+		//output only grows, so once it is past the bound the result can no longer be used.
+		if (++nGroups % LZ_BOUND_INTERVAL == 0 && compressionExceedsBound(bound, nSize)) {
+			lzParserFree(&parser);
+			free(compressedBase);
+			return NULL;
+		}
+
 		//make note of where to store the head for later.
 		char *headLocation = compressed;
 		compressed++;
@@ -217,28 +1070,9 @@ char *lz77compress(char *buffer, int size, unsigned int *compressedSize){
 				continue;
 			}
 
-			//search backwards up to 0xFFF bytes.
-			int maxSearch = 0x1000;
-			if (maxSearch > nProcessedBytes) maxSearch = nProcessedBytes;
-
-			//the biggest match, and where it was
-			int biggestRun = 0, biggestRunIndex = 0;
-
-			//begin searching backwards.
-			for (int j = 2; j < maxSearch; j++) {
-				//compare up to 0xF bytes, at most j bytes.
-				int nCompare = 0x12;
-				if (nCompare > j) nCompare = j;
-				int nBytesLeft = size - nProcessedBytes;
-				int nAbsoluteMaxCompare = 0x12;
-				if (nAbsoluteMaxCompare > nBytesLeft) nAbsoluteMaxCompare = nBytesLeft;
-				int nMatched = compareMemory(buffer - j, buffer, nCompare, nAbsoluteMaxCompare);
-				if (nMatched > biggestRun) {
-					if (biggestRun == 0x12) break;
-					biggestRun = nMatched;
-					biggestRunIndex = j;
-				}
-			}
+			//get the next match from the parser.
+			int biggestRunIndex = 0;
+			int biggestRun = lzParserNext(&parser, &biggestRunIndex);
 
 			//if the biggest run is at least 3, then we use it.
 			if (biggestRun >= 3) {
@@ -261,13 +1095,18 @@ char *lz77compress(char *buffer, int size, unsigned int *compressedSize){
 		*headLocation = head;
 		if (nProcessedBytes >= size) break;
 	}
+	lzParserFree(&parser);
 	*compressedSize = nSize;
 	return realloc(compressedBase, nSize);
 
 }//22999
 
-char *lz77HeaderCompress(char *buffer, int size, int *compressedSize) {
-	char *compressed = lz77compress(buffer, size, compressedSize);
+char *lz77compress(char *buffer, int size, unsigned int *compressedSize, int level) {
+	return lz77compressBounded(buffer, size, compressedSize, level, NULL);
+}
+
+static char *lz77HeaderCompressBounded(char *buffer, int size, int *compressedSize, int level, const COMPRESSIONBOUND *bound) {
+	char *compressed = lz77compressBounded(buffer, size, (unsigned int *) compressedSize, level, bound);
 	if (compressed == NULL) return NULL;
 	*compressedSize += 4;
 	compressed = realloc(compressed, *compressedSize);
@@ -279,16 +1118,34 @@ char *lz77HeaderCompress(char *buffer, int size, int *compressedSize) {
 	return compressed;
 }
 
-char *lz11compress(char *buffer, int size, int *compressedSize) {
-	int compressedMaxSize = 7 + 9 * ((size + 7) >> 3);
+char *lz77HeaderCompress(char *buffer, int size, int *compressedSize, int level) {
+	return lz77HeaderCompressBounded(buffer, size, compressedSize, level, NULL);
+}
+
+static char *lz11compressBounded(char *buffer, int size, int *compressedSize, int level, const COMPRESSIONBOUND *bound) {
+	int compressedMaxSize = LZ11_MAX_COMPRESSED_SIZE(size);
 	char *compressed = (char *) malloc(compressedMaxSize);
+	LZPARSER parser;
+	if (!lzParserInit(&parser, (unsigned char *) buffer, size, level, 1) || compressed == NULL) {
+		lzParserFree(&parser);
+		free(compressed);
+		return NULL;
+	}
 	char *compressedBase = compressed;
 	*(unsigned *) compressed = size << 8;
 	*compressed = 0x11;
 	int nProcessedBytes = 0;
 	int nSize = 4;
+	int nGroups = 0;
 	compressed += 4;
-	while (1) {
+	while (nProcessedBytes < size) {
+		//output only grows, so once it is past the bound the result can no longer be used.
+		if (++nGroups % LZ_BOUND_INTERVAL == 0 && compressionExceedsBound(bound, nSize)) {
+			lzParserFree(&parser);
+			free(compressedBase);
+			return NULL;
+		}
+
 		//make note of where to store the head for later.
 		char *headLocation = compressed;
 		compressed++;
@@ -309,28 +1166,9 @@ char *lz11compress(char *buffer, int size, int *compressedSize) {
 				continue;
 			}
 
-			//search backwards up to 0xFFF bytes.
-			int maxSearch = 0x1000;
-			if (maxSearch > nProcessedBytes) maxSearch = nProcessedBytes;
-
-			//the biggest match, and where it was
-			int biggestRun = 0, biggestRunIndex = 0;
-
-			//begin searching backwards.
-			for (int j = 2; j < maxSearch; j++) {
-				//compare up to 0xF bytes, at most j bytes.
-				int nCompare = 0xFFFF + 0x111; //max run length
-				if (nCompare > j) nCompare = j;
-				int nBytesLeft = size - nProcessedBytes;
-				int nAbsoluteMaxCompare = 0xFFFF + 0x111; //max run length
-				if (nAbsoluteMaxCompare > nBytesLeft) nAbsoluteMaxCompare = nBytesLeft;
-				int nMatched = compareMemory(buffer - j, buffer, nCompare, nAbsoluteMaxCompare);
-				if (nMatched > biggestRun) {
-					if (biggestRun == 0x12) break;
-					biggestRun = nMatched;
-					biggestRunIndex = j;
-				}
-			}
+			//get the next match from the parser.
+			int biggestRunIndex = 0;
+			int biggestRun = lzParserNext(&parser, &biggestRunIndex);
 
 			//if the biggest run is at least 3, then we use it.
 			if (biggestRun >= 3) {
@@ -377,90 +1215,353 @@ char *lz11compress(char *buffer, int size, int *compressedSize) {
 		*(compressed++) = 0;
 		nSize++;
 	}
+	lzParserFree(&parser);
 	*compressedSize = nSize;
 	return realloc(compressedBase, nSize);
 }
 
+char *lz11compress(char *buffer, int size, int *compressedSize, int level) {
+	return lz11compressBounded(buffer, size, compressedSize, level, NULL);
+}
+
+//----- Streaming compression
+
+//input a stream takes in at a time past what it has to keep.
+#define LZ_STREAM_CHUNK 0x4000
+
+struct COMPRESSIONSTREAM_ {
+	int compression;
+	int size; //uncompressed size; the header holds it, so it is given up front
+	int nFed; //bytes of input taken so far
+	LZPARSER parser; //positions in the parser and its match finder are relative to buffer
+	unsigned char *buffer; //the window behind the parser and the input fed past it
+	int capacity;
+	int lookahead; //bytes that have to follow a position before it is parsed, unless the input is all in
+	unsigned char group[1 + 8 * 4]; //flag byte and tokens of the group being built
+	int groupSize, nGroupTokens;
+	unsigned char out[40]; //bytes ready to be drained
+	int outStart, outEnd;
+	int nProduced; //compressed bytes produced, not counting the LZ77_HEADER prefix
+	int headerDone, finished;
+};
+
+COMPRESSIONSTREAM *compressStreamCreate(int compression, int size, int level) {
+	if (compression != COMPRESSION_LZ77 && compression != COMPRESSION_LZ11 && compression != COMPRESSION_LZ77_HEADER) return NULL;
+	if (size < 0 || size > 0xFFFFFF) return NULL;
+	COMPRESSIONSTREAM *stream = (COMPRESSIONSTREAM *) calloc(1, sizeof(COMPRESSIONSTREAM));
+	if (stream == NULL) return NULL;
+	stream->compression = compression;
+	stream->size = size;
+
+	//with this much data after every position, the parser sees what it would in the whole buffer and
+	//makes the same choices (lazy matching looks one byte further, optimal parsing a whole block).
+	int useTree = compression == COMPRESSION_LZ11;
+	int maxLen = useTree ? LZ11_MAX_LENGTH : LZ77_MAX_LENGTH;
+	stream->lookahead = maxLen + 1;
+	if (level == COMPRESSION_LEVEL_OPTIMAL) stream->lookahead += LZ_OPT_BLOCK_SIZE;
+	//the match finder trails the parser by at most the lookahead, and needs a window behind that.
+	stream->capacity = 2 * LZ_WINDOW_SIZE + 2 * stream->lookahead + LZ_STREAM_CHUNK;
+	stream->buffer = (unsigned char *) malloc(stream->capacity);
+	if (stream->buffer == NULL || !lzParserInit(&stream->parser, stream->buffer, 0, level, useTree)) {
+		compressStreamFree(stream);
+		return NULL;
+	}
+	//the slots are rebased when the window slides, so keep them defined.
+	if (stream->parser.chain) memset(stream->parser.chain->prev, 0xFF, sizeof(stream->parser.chain->prev));
+	if (stream->parser.tree) memset(stream->parser.tree->son, 0xFF, sizeof(stream->parser.tree->son));
+	return stream;
+}
+
+void compressStreamFree(COMPRESSIONSTREAM *stream) {
+	if (stream == NULL) return;
+	lzParserFree(&stream->parser);
+	free(stream->buffer);
+	free(stream);
+}
+
+static void lzRebase(int *positions, int n, int shift) {
+	for (int i = 0; i < n; i++) {
+		positions[i] = positions[i] >= shift ? positions[i] - shift : LZ_NIL;
+	}
+}
+
+//drop input more than a window behind both the parser and the match finder. Shifts are whole windows,
+//so the match finders' slots (indexed by position within the window) stay where they are.
+static void compressStreamSlide(COMPRESSIONSTREAM *stream) {
+	LZPARSER *parser = &stream->parser;
+	int nInserted = parser->chain ? parser->chain->nInserted : parser->tree->nInserted;
+	int oldest = parser->pos < nInserted ? parser->pos : nInserted;
+	int shift = (oldest - LZ_WINDOW_SIZE) & ~LZ_WINDOW_MASK;
+	if (shift <= 0) return;
+
+	memmove(stream->buffer, stream->buffer + shift, parser->size - shift);
+	parser->size -= shift;
+	parser->pos -= shift;
+	parser->planStart -= shift;
+	parser->planEnd -= shift;
+	if (parser->chain) {
+		lzRebase(parser->chain->head, LZ_HASH_SIZE, shift);
+		lzRebase(parser->chain->prev, LZ_WINDOW_SIZE, shift);
+		parser->chain->nInserted -= shift;
+	} else {
+		lzRebase(parser->tree->head, LZ_HASH_SIZE, shift);
+		lzRebase(parser->tree->son, LZ_WINDOW_SIZE * 2, shift);
+		parser->tree->nInserted -= shift;
+	}
+}
+
+int compressStreamFeed(COMPRESSIONSTREAM *stream, const char *input, int size) {
+	LZPARSER *parser = &stream->parser;
+	if (size > stream->size - stream->nFed) size = stream->size - stream->nFed;
+	if (size > stream->capacity - parser->size) compressStreamSlide(stream);
+	int nTaken = stream->capacity - parser->size;
+	if (nTaken > size) nTaken = size;
+	memcpy(stream->buffer + parser->size, input, nTaken);
+	parser->size += nTaken;
+	stream->nFed += nTaken;
+	return nTaken;
+}
+
+static void compressStreamOut(COMPRESSIONSTREAM *stream, const unsigned char *data, int size) {
+	memcpy(stream->out + stream->outEnd, data, size);
+	stream->outEnd += size;
+}
+
+static void compressStreamHeader(COMPRESSIONSTREAM *stream) {
+	if (stream->compression == COMPRESSION_LZ77_HEADER) {
+		compressStreamOut(stream, (const unsigned char *) "LZ77", 4);
+	}
+	unsigned char header[4];
+	header[0] = stream->compression == COMPRESSION_LZ11 ? 0x11 : 0x10;
+	header[1] = stream->size & 0xFF;
+	header[2] = (stream->size >> 8) & 0xFF;
+	header[3] = (stream->size >> 16) & 0xFF;
+	compressStreamOut(stream, header, 4);
+	stream->nProduced += 4;
+	stream->headerDone = 1;
+}
+
+static void compressStreamToken(COMPRESSIONSTREAM *stream, int len, int dist, unsigned char literal) {
+	if (stream->nGroupTokens == 0) {
+		stream->group[0] = 0;
+		stream->groupSize = 1;
+	}
+	unsigned char *token = stream->group + stream->groupSize;
+	if (len < 3) {
+		token[0] = literal;
+		stream->groupSize++;
+	} else {
+		stream->group[0] |= 0x80 >> stream->nGroupTokens;
+		dist--;
+		if (stream->compression != COMPRESSION_LZ11) {
+			token[0] = ((len - 3) << 4) | ((dist >> 8) & 0xF);
+			token[1] = dist & 0xFF;
+			stream->groupSize += 2;
+		} else if (len <= 0x10) {
+			token[0] = ((len - 1) << 4) | ((dist >> 8) & 0xF);
+			token[1] = dist & 0xFF;
+			stream->groupSize += 2;
+		} else if (len <= 0xFF + 0x11) {
+			token[0] = (len - 0x11) >> 4;
+			token[1] = (((len - 0x11) & 0xF) << 4) | (dist >> 8);
+			token[2] = dist & 0xFF;
+			stream->groupSize += 3;
+		} else {
+			token[0] = 0x10 | (((len - 0x111) >> 12) & 0xF);
+			token[1] = ((len - 0x111) >> 4) & 0xFF;
+			token[2] = (((len - 0x111) & 0xF) << 4) | ((dist >> 8) & 0xF);
+			token[3] = dist & 0xFF;
+			stream->groupSize += 4;
+		}
+	}
+	if (++stream->nGroupTokens == 8) {
+		compressStreamOut(stream, stream->group, stream->groupSize);
+		stream->nProduced += stream->groupSize;
+		stream->nGroupTokens = 0;
+	}
+}
+
+//close the last group the way the whole-buffer compressors do, zero-filling its unused tokens,
+//and pad LZ11 data to a multiple of 4 bytes.
+static void compressStreamEnd(COMPRESSIONSTREAM *stream) {
+	if (stream->nGroupTokens > 0) {
+		while (stream->nGroupTokens < 8) {
+			stream->group[stream->groupSize++] = 0;
+			stream->nGroupTokens++;
+		}
+		compressStreamOut(stream, stream->group, stream->groupSize);
+		stream->nProduced += stream->groupSize;
+		stream->nGroupTokens = 0;
+	}
+	if (stream->compression == COMPRESSION_LZ11) {
+		static const unsigned char zeros[3] = { 0 };
+		int nPadding = (4 - (stream->nProduced & 3)) & 3;
+		compressStreamOut(stream, zeros, nPadding);
+		stream->nProduced += nPadding;
+	}
+	stream->finished = 1;
+}
+
+int compressStreamDrain(COMPRESSIONSTREAM *stream, char *output, int size) {
+	LZPARSER *parser = &stream->parser;
+	int n = 0;
+	while (n < size) {
+		if (stream->outStart < stream->outEnd) {
+			int nCopied = stream->outEnd - stream->outStart;
+			if (nCopied > size - n) nCopied = size - n;
+			memcpy(output + n, stream->out + stream->outStart, nCopied);
+			n += nCopied;
+			stream->outStart += nCopied;
+			if (stream->outStart == stream->outEnd) stream->outStart = stream->outEnd = 0;
+			continue;
+		}
+		if (stream->finished) break;
+		if (!stream->headerDone) {
+			compressStreamHeader(stream);
+			continue;
+		}
+		int isComplete = stream->nFed == stream->size;
+		if (isComplete && parser->pos >= parser->size) {
+			compressStreamEnd(stream);
+			continue;
+		}
+		if (!isComplete && parser->size - parser->pos < stream->lookahead) {
+			//wait for more input, making room for it first.
+			compressStreamSlide(stream);
+			break;
+		}
+		int pos = parser->pos;
+		int dist = 0;
+		int len = lzParserNext(parser, &dist);
+		compressStreamToken(stream, len, dist, stream->buffer[pos]);
+	}
+	return n;
+}
+
+int compressStreamFinish(COMPRESSIONSTREAM *stream) {
+	return stream->finished && stream->outStart == stream->outEnd;
+}
+
 typedef struct HUFFNODE_ {
 	unsigned char sym;
-	unsigned char symMin; //had space to spare, maybe make searches a little simpler
-	unsigned char symMax;
-	unsigned char nRepresent;
-	int freq;
+	unsigned short nRepresent;
+	unsigned int freq;
 	struct HUFFNODE_ *left;
 	struct HUFFNODE_ *right;
 } HUFFNODE;
 
-typedef struct BITSTREAM_ {
-	unsigned *bits;
-	int nWords;
-	int nBitsInLastWord;
-	int nWordsAlloc;
-} BITSTREAM;
+typedef struct BITWRITER_ {
+	uint32_t *out;
+	uint64_t acc;
+	int nBits;
+} BITWRITER;
 
-void bitStreamCreate(BITSTREAM *stream) {
-	stream->nWords = 1;
-	stream->nBitsInLastWord = 0;
-	stream->nWordsAlloc = 16;
-	stream->bits = (unsigned *) calloc(16, 4);
+void bitWriterInit(BITWRITER *writer, uint32_t *out) {
+	writer->out = out;
+	writer->acc = 0;
+	writer->nBits = 0;
 }
 
-void bitStreamFree(BITSTREAM *stream) {
-	free(stream->bits);
+static inline void bitWriterPut(BITWRITER *writer, uint32_t bits, int nBits) {
+	//at most 31 bits are ever pending, so up to 32 more always fit in the accumulator.
+	writer->acc = (writer->acc << nBits) | bits;
+	writer->nBits += nBits;
+	if (writer->nBits >= 32) {
+		writer->nBits -= 32;
+		*writer->out++ = (uint32_t) (writer->acc >> writer->nBits);
+	}
 }
 
-void bitStreamWrite(BITSTREAM *stream, int bit) {
-	if (stream->nBitsInLastWord == 32) {
-		stream->nBitsInLastWord = 0;
-		stream->nWords++;
-		if (stream->nWords > stream->nWordsAlloc) {
-			int newAllocSize = (stream->nWordsAlloc + 2) * 3 / 2;
-			stream->bits = realloc(stream->bits, newAllocSize * 4);
-			stream->nWordsAlloc = newAllocSize;
-		}
-		stream->bits[stream->nWords - 1] = 0;
+static inline void bitWriterPutCode(BITWRITER *writer, uint64_t code, int length) {
+	if (length > 32) {
+		bitWriterPut(writer, (uint32_t) (code >> 32), length - 32);
+		length = 32;
 	}
+	bitWriterPut(writer, (uint32_t) code, length);
+}
 
-	stream->bits[stream->nWords - 1] |= (bit << (31 - stream->nBitsInLastWord));
-	stream->nBitsInLastWord++;
+void bitWriterFlush(BITWRITER *writer) {
+	//words are filled from the most significant bit down.
+	if (writer->nBits) {
+		*writer->out++ = (uint32_t) (writer->acc << (32 - writer->nBits));
+		writer->nBits = 0;
+	}
 }
 
 #define ISLEAF(n) ((n)->left==NULL&&(n)->right==NULL)
 
 int huffNodeComparator(const void *p1, const void *p2) {
-	return ((HUFFNODE *) p2)->freq - ((HUFFNODE *) p1)->freq;
+	//least frequent first; ties go to the lower symbol so the tree is reproducible.
+	const HUFFNODE *n1 = (const HUFFNODE *) p1;
+	const HUFFNODE *n2 = (const HUFFNODE *) p2;
+	if (n1->freq != n2->freq) return n1->freq < n2->freq ? -1 : 1;
+	return n1->sym - n2->sym;
 }
 
-unsigned int huffmanWriteNode(unsigned char *tree, unsigned int pos, HUFFNODE *node) {
-	HUFFNODE *left = node->left;
-	HUFFNODE *right = node->right;
-
-	//we will write two bytes. 
-	unsigned int afterPos = pos + 2;
-	if (ISLEAF(left)) {
-		tree[pos] = left->sym;
-	} else {
-		HUFFNODE *leftLeft = left->left;
-		HUFFNODE *leftRight = left->right;
-		unsigned char flag = (ISLEAF(leftLeft) << 7) | (ISLEAF(leftRight) << 6);
-		unsigned lastAfterPos = afterPos;
-		afterPos = huffmanWriteNode(tree, afterPos, left);
-		tree[pos] = flag | ((((lastAfterPos - pos) >> 1) - 1) & 0x3F);
-		if (((lastAfterPos - pos) >> 1) - 1 > 0x3F) _asm int 3;
+typedef struct HUFFSLOT_ {
+	HUFFNODE *node;
+	unsigned int slot; //byte in the tree table that will describe this node
+} HUFFSLOT;
+
+//a node's children must be placed within 0x40 pairs of the pair holding the node.
+#define HUFF_SLOT_DEADLINE(s) (((s)->slot >> 1) + 0x40)
+
+int huffmanCanPlace(HUFFSLOT *pending, int nPending, int index, unsigned int pair) {
+	//placing pending[index] at pair must leave every other node able to go,
+	//oldest first, into the pairs that follow.
+	if (HUFF_SLOT_DEADLINE(pending + index) < pair) return 0;
+	unsigned int next = pair + 1;
+	for (int i = 0; i < nPending; i++) {
+		if (i == index) continue;
+		if (HUFF_SLOT_DEADLINE(pending + i) < next) return 0;
+		next++;
 	}
+	return 1;
+}
 
-	if (ISLEAF(right)) {
-		tree[pos + 1] = right->sym;
-	} else {
-		HUFFNODE *rightLeft = right->left;
-		HUFFNODE *rightRight = right->right;
-		unsigned char flag = (ISLEAF(rightLeft) << 7) | (ISLEAF(rightRight) << 6);
-		unsigned lastAfterPos = afterPos;
-		afterPos = huffmanWriteNode(tree, afterPos, right);
-		tree[pos + 1] = flag | ((((lastAfterPos - pos) >> 1) - 1) & 0x3F);
-		if (((lastAfterPos - pos) >> 1) - 1 > 0x3F) _asm int 3;
+unsigned int huffmanWriteTree(unsigned char *tree, HUFFNODE *root) {
+	//child offsets are only 6 bits, so nodes can't simply be written depth-first: a large
+	//left subtree would push its sibling's children out of reach. Instead, lay pairs out
+	//depth-first (which keeps few nodes waiting), but place the oldest waiting node
+	//whenever going deeper would leave it unreachable. returns 0 if the tree can't fit.
+	HUFFSLOT pending[256];
+	int nPending = 0;
+	pending[nPending].node = root;
+	pending[nPending].slot = 1;
+	nPending++;
+
+	unsigned int pair = 1;
+	while (nPending > 0) {
+		int index = nPending - 1;
+		if (!huffmanCanPlace(pending, nPending, index, pair)) {
+			index = 0;
+			if (!huffmanCanPlace(pending, nPending, index, pair)) return 0;
+		}
+
+		HUFFSLOT placed = pending[index];
+		memmove(pending + index, pending + index + 1, (nPending - index - 1) * sizeof(HUFFSLOT));
+		nPending--;
+
+		HUFFNODE *left = placed.node->left;
+		HUFFNODE *right = placed.node->right;
+		unsigned char offset = pair - (placed.slot >> 1) - 1;
+		tree[placed.slot] = (ISLEAF(left) << 7) | (ISLEAF(right) << 6) | offset;
+
+		//the pending list stays ordered by slot, and so by deadline.
+		HUFFNODE *children[2] = { left, right };
+		for (int i = 0; i < 2; i++) {
+			unsigned int pos = pair * 2 + i;
+			if (ISLEAF(children[i])) {
+				tree[pos] = children[i]->sym;
+			} else {
+				pending[nPending].node = children[i];
+				pending[nPending].slot = pos;
+				nPending++;
+			}
+		}
+		pair++;
 	}
-	return afterPos;
+	return pair * 2;
 }
 
 void makeShallowNodeFirst(HUFFNODE *node) {
@@ -474,123 +1575,145 @@ void makeShallowNodeFirst(HUFFNODE *node) {
 	makeShallowNodeFirst(node->right);
 }
 
-int huffmanNodeHasSymbol(HUFFNODE *node, unsigned char sym) {
-	if (ISLEAF(node)) return node->sym == sym;
-	if (sym < node->symMin || sym > node->symMax) return 0;
-	HUFFNODE *left = node->left;
-	HUFFNODE *right = node->right;
-	return huffmanNodeHasSymbol(left, sym) || huffmanNodeHasSymbol(right, sym);
+void huffmanAssignCodes(HUFFNODE *node, uint64_t code, int length, uint64_t *codes, int *lengths) {
+	if (ISLEAF(node)) {
+		codes[node->sym] = code;
+		lengths[node->sym] = length;
+		return;
+	}
+
+	//left is a 0 bit, right is a 1 bit.
+	huffmanAssignCodes(node->left, code << 1, length + 1, codes, lengths);
+	huffmanAssignCodes(node->right, (code << 1) | 1, length + 1, codes, lengths);
 }
 
-void huffmanWriteSymbol(BITSTREAM *bits, unsigned char sym, HUFFNODE *tree) {
-	if (ISLEAF(tree)) return;
-	HUFFNODE *left = tree->left;
-	HUFFNODE *right = tree->right;
-	if (huffmanNodeHasSymbol(left, sym)) {
-		bitStreamWrite(bits, 0);
-		huffmanWriteSymbol(bits, sym, left);
-	} else {
-		bitStreamWrite(bits, 1);
-		huffmanWriteSymbol(bits, sym, right);
+HUFFNODE *huffmanTakeLowest(HUFFNODE *pool, int *leafHead, int leafTail, int *branchHead, int branchTail) {
+	//both queues are sorted by frequency; a leaf wins ties with a branch.
+	if (*branchHead == branchTail || (*leafHead < leafTail && pool[*leafHead].freq <= pool[*branchHead].freq)) {
+		return pool + (*leafHead)++;
 	}
+	return pool + (*branchHead)++;
 }
 
-void huffmanConstructTree(HUFFNODE *nodes, int nNodes) {
-	//sort by frequency, then cut off the remainder (freq=0).
-	qsort(nodes, nNodes, sizeof(HUFFNODE), huffNodeComparator);
-	for (int i = 0; i < nNodes; i++) {
-		if (nodes[i].freq == 0) {
-			nNodes = i;
-			break;
-		}
+HUFFNODE *huffmanConstructTree(HUFFNODE *pool, unsigned int *histogram, int nSym) {
+	//gather the symbols that occur into the front of the pool, least frequent first.
+	int nLeaves = 0;
+	for (int i = 0; i < nSym; i++) {
+		if (histogram[i] == 0) continue;
+		HUFFNODE *leaf = pool + nLeaves++;
+		leaf->sym = i;
+		leaf->nRepresent = 1;
+		leaf->freq = histogram[i];
+		leaf->left = NULL;
+		leaf->right = NULL;
 	}
 
-	//unflatten the histogram into a huffman tree. 
-	int nRoots = nNodes;
-	int nTotalNodes = nNodes;
-	while (nRoots > 1) {
-		//copy bottom two nodes to just outside the current range
-		HUFFNODE *srcA = nodes + nRoots - 2;
-		HUFFNODE *destA = nodes + nTotalNodes;
-		memcpy(destA, srcA, sizeof(HUFFNODE));
-
-		HUFFNODE *left = destA;
-		HUFFNODE *right = nodes + nRoots - 1;
-		HUFFNODE *branch = srcA;
+	//the format can't describe a lone leaf, so pad with unused symbols until there are two.
+	for (int i = 0; nLeaves < 2; i++) {
+		if (nLeaves == 1 && pool[0].sym == i) continue;
+		HUFFNODE *leaf = pool + nLeaves++;
+		leaf->sym = i;
+		leaf->nRepresent = 1;
+		leaf->freq = 0;
+		leaf->left = NULL;
+		leaf->right = NULL;
+	}
+	qsort(pool, nLeaves, sizeof(HUFFNODE), huffNodeComparator);
+
+	//merge the two lowest roots until one is left. branches are created in order of
+	//frequency, so they form a second sorted queue right after the leaves.
+	int leafHead = 0;
+	int branchHead = nLeaves;
+	int branchTail = nLeaves;
+	while ((nLeaves - leafHead) + (branchTail - branchHead) > 1) {
+		HUFFNODE *left = huffmanTakeLowest(pool, &leafHead, nLeaves, &branchHead, branchTail);
+		HUFFNODE *right = huffmanTakeLowest(pool, &leafHead, nLeaves, &branchHead, branchTail);
+		HUFFNODE *branch = pool + branchTail++;
 
 		branch->freq = left->freq + right->freq;
 		branch->sym = 0;
 		branch->left = left;
 		branch->right = right;
-		branch->symMin = min(left->symMin, right->symMin);
-		branch->symMax = max(right->symMax, left->symMax);
-		branch->nRepresent = left->nRepresent + right->nRepresent; //may overflow for root, but the root doesn't really matter for this
-
-		nRoots--;
-		nTotalNodes++;
-		qsort(nodes, nRoots, sizeof(HUFFNODE), huffNodeComparator);
+		branch->nRepresent = left->nRepresent + right->nRepresent;
 	}
 
 	//just to be sure, make sure the shallow node always comes first
-	makeShallowNodeFirst(nodes);
+	HUFFNODE *root = pool + branchTail - 1;
+	makeShallowNodeFirst(root);
+	return root;
 }
 
 char *huffmanCompress(unsigned char *buffer, int size, int *compressedSize, int nBits) {
-	if (nBits == 8) nBits = 4; //HACK: Force 4-bit Huffman Compression until 8-bit Huffman Compression is fixed
 	//create a histogram of each byte in the file.
-	HUFFNODE *nodes = (HUFFNODE *) calloc(512, sizeof(HUFFNODE));
 	int nSym = 1 << nBits;
-	for (int i = 0; i < nSym; i++) {
-		nodes[i].sym = i;
-		nodes[i].symMin = i;
-		nodes[i].symMax = i;
-		nodes[i].nRepresent = 1;
-	}
-
-	//construct histogram
+	unsigned int histogram[256] = { 0 };
 	if (nBits == 8) {
 		for (int i = 0; i < size; i++) {
-			nodes[buffer[i]].freq++;
+			histogram[buffer[i]]++;
 		}
 	} else {
 		for (int i = 0; i < size; i++) {
-			nodes[buffer[i] & 0xF].freq++;
-			nodes[buffer[i] >> 4].freq++;
+			histogram[buffer[i] & 0xF]++;
+			histogram[buffer[i] >> 4]++;
 		}
 	}
 
-	huffmanConstructTree(nodes, nSym);
+	//a tree over at most 256 symbols has at most 511 nodes.
+	HUFFNODE pool[511];
+	HUFFNODE *nodes = huffmanConstructTree(pool, histogram, nSym);
 
 	//now we've got a proper Huffman tree. Great! 
-	unsigned char *tree = (unsigned char *) calloc(512, 1);
-	uint32_t treeSize = huffmanWriteNode(tree, 2, nodes);
+	unsigned char tree[512] = { 0 };
+	uint32_t treeSize = huffmanWriteTree(tree, nodes);
+	if (treeSize == 0) {
+		//no layout fit the 6-bit offsets; 16-symbol trees always fit.
+		return huffmanCompress(buffer, size, compressedSize, 4);
+	}
 	treeSize = (treeSize + 3) & ~3; //round up
 	tree[0] = (treeSize >> 1) - 1;
-	tree[1] = 0;
+
+	//build the code table once, and size the bit stream from the histogram.
+	uint64_t codes[256];
+	int lengths[256] = { 0 };
+	huffmanAssignCodes(nodes, 0, 0, codes, lengths);
+	uint64_t nStreamBits = 0;
+	int padSym = -1;
+	for (int i = 0; i < nSym; i++) {
+		nStreamBits += (uint64_t) histogram[i] * lengths[i];
+		if (lengths[i] && (padSym == -1 || lengths[i] < lengths[padSym])) padSym = i;
+	}
+
+	//the decoder fills whole output words, so pad the data out to a multiple of 4 bytes with
+	//the cheapest symbol to have bits for the part of the last word that is thrown away.
+	int nPadSyms = (((size + 3) & ~3) - size) * 8 / nBits;
+	nStreamBits += (uint64_t) nPadSyms * lengths[padSym];
+	uint32_t nWords = (uint32_t) ((nStreamBits + 31) / 32);
+
+	//combine into one
+	uint32_t outSize = 4 + treeSize + nWords * 4;
+	char *finBuf = (char *) malloc(outSize);
+	*(uint32_t *) finBuf = 0x20 | nBits | (size << 8);
+	memcpy(finBuf + 4, tree, treeSize);
 
 	//now write bits out.
-	BITSTREAM stream;
-	bitStreamCreate(&stream);
+	uint32_t *words = (uint32_t *) (finBuf + 4 + treeSize);
+	BITWRITER writer;
+	bitWriterInit(&writer, words);
 	if (nBits == 8) {
 		for (int i = 0; i < size; i++) {
-			huffmanWriteSymbol(&stream, buffer[i], nodes);
+			bitWriterPutCode(&writer, codes[buffer[i]], lengths[buffer[i]]);
 		}
 	} else {
 		for (int i = 0; i < size; i++) {
-			huffmanWriteSymbol(&stream, buffer[i] & 0xF, nodes);
-			huffmanWriteSymbol(&stream, buffer[i] >> 4, nodes);
+			unsigned char lo = buffer[i] & 0xF, hi = buffer[i] >> 4;
+			bitWriterPutCode(&writer, codes[lo], lengths[lo]);
+			bitWriterPutCode(&writer, codes[hi], lengths[hi]);
 		}
 	}
-
-	//combine into one
-	uint32_t outSize = 4 + treeSize + stream.nWords * 4;
-	char *finBuf = (char *) malloc(outSize);
-	*(uint32_t *) finBuf = 0x20 | nBits | (size << 8);
-	memcpy(finBuf + 4, tree, treeSize);
-	memcpy(finBuf + 4 + treeSize, stream.bits, stream.nWords * 4);
-	free(tree);
-	free(nodes);
-	bitStreamFree(&stream);
+	for (int i = 0; i < nPadSyms; i++) {
+		bitWriterPutCode(&writer, codes[padSym], lengths[padSym]);
+	}
+	bitWriterFlush(&writer);
 
 	*compressedSize = outSize;
 	return finBuf;
@@ -604,16 +1727,26 @@ char *huffman4Compress(unsigned char *buffer, int size, int *compressedSize) {
 	return huffmanCompress(buffer, size, compressedSize, 4);
 }
 
-int lz77IsCompressed(char *buffer, unsigned int size) {
+//quick checks on an LZ77 header before trying to decode the rest.
+int lz77HeaderIsPlausible(char *buffer, unsigned int size) {
 	if (size < 4) return 0;
 	if (*buffer != 0x10) return 0;
 	uint32_t length = (*(uint32_t *) buffer) >> 8;
+	if (length == 0) return 0;
+	//8 matches of 18 bytes take 17 bytes, so the data can't shrink any further than that.
 	if ((length / 144) * 17 + 4 > size) return 0;
+	return 1;
+}
+
+int lz77IsCompressed(char *buffer, unsigned int size) {
+	if (!lz77HeaderIsPlausible(buffer, size)) return 0;
+	uint32_t length = (*(uint32_t *) buffer) >> 8;
 
 	//start a dummy decompression
 	uint32_t offset = 4;
 	uint32_t dstOffset = 0;
 	while (1) {
+		if (offset >= size) return 0;
 		uint8_t head = buffer[offset];
 		offset++;
 
@@ -653,12 +1786,20 @@ int lz77HeaderIsCompressed(unsigned char *buffer, unsigned size) {
 	return lz77IsCompressed(buffer + 4, size - 4);
 }
 
-int lz11IsCompressed(char *buffer, unsigned size) {
+//quick checks on an LZ11 header before trying to decode the rest.
+int lz11HeaderIsPlausible(char *buffer, unsigned int size) {
 	if (size < 4) return 0;
 	if (*buffer != 0x11) return 0;
+	uint32_t length = (*(uint32_t *) buffer) >> 8;
+	if (length == 0) return 0;
+	//no larger than the compressor's worst case.
+	if (size > LZ11_MAX_COMPRESSED_SIZE(length)) return 0;
+	return 1;
+}
 
+int lz11IsCompressed(char *buffer, unsigned size) {
+	if (!lz11HeaderIsPlausible(buffer, size)) return 0;
 	uint32_t length = (*(uint32_t *) buffer) >> 8;
-	if (size > 7 + length * 9 / 8) return 0;
 
 	//perform a test decompression.
 	uint32_t offset = 4;
@@ -725,9 +1866,6 @@ int huffmanIsCompressed(unsigned char *buffer, unsigned size) {
 	if (*buffer != 0x24 && *buffer != 0x28) return 0;
 
 	uint32_t length = (*(uint32_t *) buffer) >> 8;
-	uint32_t bitStreamOffset = ((buffer[5] + 1) << 1) + 4;
-	if (bitStreamOffset > size) return 0;
-
 	//process huffman tree
 	uint32_t dataOffset = ((buffer[4] + 1) << 1) + 4;
 	if (dataOffset > size) return 0;
@@ -742,17 +1880,21 @@ int huffmanIsCompressed(unsigned char *buffer, unsigned size) {
 	int trOffs = 1;
 
 	int nWritten = 0;
+	int treeLimit = size - 4;
 	while (nWritten < length) {
 
+		if (dataOffset + 4 > size) return 0;
 		uint32_t bits = *(uint32_t *)(buffer + dataOffset);
 		dataOffset += 4;
 
 		for (int i = 0; i < 32; i++) {
 			int lr = (bits >> 31) & 1;
+			if (trOffs >= treeLimit) return 0;
 			unsigned char thisNode = treeBase[trOffs];
 			int thisNodeOffs = ((thisNode & 0x3F) + 1) << 1; //add to current offset rounded down to get next element offset
 
 			trOffs = (trOffs & ~1) + thisNodeOffs + lr;
+			if (trOffs >= treeLimit) return 0;
 
 			if (thisNode & (0x80 >> lr)) { //reached a leaf node!
 				outBuffer >>= symSize;
@@ -783,59 +1925,287 @@ int huffman8IsCompressed(unsigned char *buffer, unsigned size) {
 }
 
 int getCompressionType(char *buffer, int size) {
+	COUNTER_ADD(nValidatorPasses, 1);
 	if (lz77HeaderIsCompressed(buffer, size)) return COMPRESSION_LZ77_HEADER;
+	COUNTER_ADD(nValidatorPasses, 1);
 	if (lz77IsCompressed(buffer, size)) return COMPRESSION_LZ77;
+	COUNTER_ADD(nValidatorPasses, 1);
 	if (lz11IsCompressed(buffer, size)) return COMPRESSION_LZ11;
+	COUNTER_ADD(nValidatorPasses, 1);
 	if (huffman4IsCompressed(buffer, size)) return COMPRESSION_HUFFMAN_4;
+	COUNTER_ADD(nValidatorPasses, 1);
 	if (huffman8IsCompressed(buffer, size)) return COMPRESSION_HUFFMAN_8;
 
 	return COMPRESSION_NONE;
 }
 
+char *decompressDetect(char *buffer, int size, int *uncompressedSize, int *compressionType) {
+	//each format starts with its own byte, so that picks the only candidate. Decode it with the same
+	//checks its validator makes, and only call the data uncompressed if that fails.
+	unsigned char *ubuffer = (unsigned char *) buffer;
+	char *result = NULL;
+	int type = COMPRESSION_NONE;
+	int consumed;
+	int outOfMemory = 0;
+	COUNTER_ADD(nValidatorPasses, 1);
+	if (size > 0) {
+		switch (ubuffer[0]) {
+			case 'L':
+				if (size >= 8 && memcmp(buffer, "LZ77", 4) == 0 && lz77HeaderIsPlausible(buffer + 4, size - 4)) {
+					result = lz77Decode(buffer + 4, size - 4, (unsigned int *) uncompressedSize, &outOfMemory);
+					type = COMPRESSION_LZ77_HEADER;
+				}
+				break;
+			case 0x10:
+				if (lz77HeaderIsPlausible(buffer, size)) {
+					result = lz77Decode(buffer, size, (unsigned int *) uncompressedSize, &outOfMemory);
+					type = COMPRESSION_LZ77;
+				}
+				break;
+			case 0x11:
+				if (lz11HeaderIsPlausible(buffer, size)) {
+					result = lz11Decode(buffer, size, uncompressedSize, &outOfMemory);
+					type = COMPRESSION_LZ11;
+				}
+				break;
+			case 0x24:
+			case 0x28:
+				result = huffmanDecode(ubuffer, size, uncompressedSize, &consumed, &outOfMemory);
+				if (result != NULL && consumed != size) {
+					//trailing data means this isn't a single Huffman stream.
+					free(result);
+					result = NULL;
+				}
+				type = ubuffer[0] == 0x24 ? COMPRESSION_HUFFMAN_4 : COMPRESSION_HUFFMAN_8;
+				break;
+		}
+	}
+
+	//data that decodes fine but doesn't fit in memory is still compressed, and must not be used as is.
+	if (result == NULL && !outOfMemory) type = COMPRESSION_NONE;
+	*compressionType = type;
+	if (type == COMPRESSION_NONE) *uncompressedSize = size;
+	return result;
+}
+
 char *decompress(char *buffer, int size, int *uncompressedSize) {
-	int type = getCompressionType(buffer, size);
-	switch (type) {
+	int type;
+	char *result = decompressDetect(buffer, size, uncompressedSize, &type);
+	if (type == COMPRESSION_NONE) {
+		result = (char *) malloc(size);
+		if (result != NULL) memcpy(result, buffer, size);
+	}
+	return result;
+}
+
+typedef struct AUTOBOUND_ {
+	int bestSize; //size of the smallest candidate so far
+	const COMPRESSIONBOUND *outer; //the bound COMPRESSION_AUTO itself was given, or NULL
+} AUTOBOUND;
+
+static int autoBoundGetMaxSize(void *param) {
+	AUTOBOUND *autoBound = (AUTOBOUND *) param;
+	//candidates are tried in order of preference, so a later one has to be strictly smaller.
+	int maxSize = autoBound->bestSize - 1;
+	if (autoBound->outer != NULL) {
+		int outerMaxSize = autoBound->outer->getMaxSize(autoBound->outer->param);
+		if (outerMaxSize < maxSize) maxSize = outerMaxSize;
+	}
+	return maxSize;
+}
+
+int getAutoCandidates(int size, int *candidates) {
+	int nCandidates = 0;
+	candidates[nCandidates++] = COMPRESSION_NONE;
+	//every compressed format stores the uncompressed size in 24 bits.
+	if (size > 0xFFFFFF) return nCandidates;
+	candidates[nCandidates++] = COMPRESSION_LZ77;
+	candidates[nCandidates++] = COMPRESSION_LZ11;
+	candidates[nCandidates++] = COMPRESSION_HUFFMAN_8;
+	candidates[nCandidates++] = COMPRESSION_HUFFMAN_4;
+	//COMPRESSION_LZ77_HEADER is LZ77 with 4 more bytes in front, so it never wins and isn't tried.
+	return nCandidates;
+}
+
+static char *compressAuto(char *buffer, int size, int *compressedSize, int level, const COMPRESSIONBOUND *bound) {
+	int candidates[COMPRESSION_MAX_AUTO_CANDIDATES];
+	int nCandidates = getAutoCandidates(size, candidates);
+	AUTOBOUND autoBound = { INT_MAX, bound };
+	COMPRESSIONBOUND candidateBound = { autoBoundGetMaxSize, &autoBound };
+
+	//storing the data as is comes first and sets the size to beat, so candidates that would
+	//expand it are dropped early.
+	char *best = NULL;
+	for (int i = 0; i < nCandidates; i++) {
+		int candidateSize;
+		char *candidate = compressBounded(buffer, size, candidates[i], &candidateSize, level, &candidateBound);
+		if (candidate == NULL) continue;
+		free(best);
+		best = candidate;
+		autoBound.bestSize = candidateSize;
+	}
+	if (best != NULL) *compressedSize = autoBound.bestSize;
+	return best;
+}
+
+char *compressBounded(char *buffer, int size, int compression, int *compressedSize, int level, const COMPRESSIONBOUND *bound) {
+	char *compressed = NULL;
+	switch (compression) {
 		case COMPRESSION_NONE:
-		{
-			void *copy = malloc(size);
-			memcpy(copy, buffer, size);
-			*uncompressedSize = size;
-			return copy;
-		}
+			compressed = (char *) malloc(size);
+			if (compressed == NULL) return NULL;
+			memcpy(compressed, buffer, size);
+			*compressedSize = size;
+			break;
 		case COMPRESSION_LZ77:
-			return lz77decompress(buffer, size, uncompressedSize);
+			compressed = lz77compressBounded(buffer, size, (unsigned int *) compressedSize, level, bound);
+			break;
 		case COMPRESSION_LZ11:
-			return lz11decompress(buffer, size, uncompressedSize);
+			compressed = lz11compressBounded(buffer, size, compressedSize, level, bound);
+			break;
 		case COMPRESSION_HUFFMAN_4:
+			compressed = huffman4Compress((unsigned char *) buffer, size, compressedSize);
+			break;
 		case COMPRESSION_HUFFMAN_8:
-			return huffmanDecompress(buffer, size, uncompressedSize);
+			compressed = huffman8Compress((unsigned char *) buffer, size, compressedSize);
+			break;
 		case COMPRESSION_LZ77_HEADER:
-			return lz77HeaderDecompress(buffer, size, uncompressedSize);
+			compressed = lz77HeaderCompressBounded(buffer, size, compressedSize, level, bound);
+			break;
+		case COMPRESSION_AUTO:
+			return compressAuto(buffer, size, compressedSize, level, bound);
 	}
-	return NULL;
+	if (compressed != NULL && compressionExceedsBound(bound, *compressedSize)) {
+		free(compressed);
+		return NULL;
+	}
+	return compressed;
 }
 
-char *compress(char *buffer, int size, int compression, int *compressedSize) {
-	switch (compression) {
-		case COMPRESSION_NONE:
-		{
-			void *copy = malloc(size);
-			memcpy(copy, buffer, size);
-			*compressedSize = size;
-			return copy;
+char *compress(char *buffer, int size, int compression, int *compressedSize, int level) {
+	return compressBounded(buffer, size, compression, compressedSize, level, NULL);
+}
+
+//the estimate looks at up to this many evenly spaced blocks of one LZ window each.
+#define ESTIMATE_BLOCK_SIZE 0x1000
+#define ESTIMATE_MAX_BLOCKS 16
+//enough hash slots that the two windows hashed per block rarely push each other out.
+#define ESTIMATE_HASH_BITS 14
+
+static double entropyOf(const unsigned int *histogram, int nSym, unsigned int total) {
+	double entropy = 0.0;
+	for (int i = 0; i < nSym; i++) {
+		if (histogram[i] == 0) continue;
+		double p = (double) histogram[i] / total;
+		entropy -= p * log2(p);
+	}
+	return entropy;
+}
+
+void estimateCompression(char *buffer, int size, COMPRESSIONESTIMATE *estimate) {
+	unsigned char *data = (unsigned char *) buffer;
+	unsigned int histogram[256] = { 0 };
+	unsigned int nibbles[16] = { 0 };
+	unsigned int nCovered = 0, nPositions = 0;
+
+	//spread the blocks over the buffer; when it is small enough, they simply cover all of it.
+	int nBlocks = (size + ESTIMATE_BLOCK_SIZE - 1) / ESTIMATE_BLOCK_SIZE;
+	int stride = ESTIMATE_BLOCK_SIZE;
+	if (nBlocks > ESTIMATE_MAX_BLOCKS) {
+		nBlocks = ESTIMATE_MAX_BLOCKS;
+		stride = (size - ESTIMATE_BLOCK_SIZE) / (ESTIMATE_MAX_BLOCKS - 1);
+	}
+	for (int b = 0; b < nBlocks; b++) {
+		int start = b * stride;
+		int end = start + ESTIMATE_BLOCK_SIZE;
+		if (end > size) end = size;
+
+		//last position + 1 of each 3-byte hash, relative to the window before the block, which is
+		//hashed first but not counted, so repeats at the start of the block are found as well.
+		//Only repeats within one window are counted, as only those are ones the LZ compressors can use.
+		int windowStart = start > ESTIMATE_BLOCK_SIZE ? start - ESTIMATE_BLOCK_SIZE : 0;
+		unsigned short head[1 << ESTIMATE_HASH_BITS] = { 0 };
+		for (int i = windowStart; i + 3 <= start; i++) {
+			unsigned int hash = ((data[i] << 16 | data[i + 1] << 8 | data[i + 2]) * 2654435761u) >> (32 - ESTIMATE_HASH_BITS);
+			head[hash] = (unsigned short) (i - windowStart + 1);
 		}
+		//a run of positions whose 3 bytes repeat is one match, covering two more bytes than the run.
+		int inRun = 0;
+		for (int i = start; i < end; i++) {
+			histogram[data[i]]++;
+			nibbles[data[i] & 0xF]++;
+			nibbles[data[i] >> 4]++;
+			nPositions++;
+			if (i + 3 > size) continue;
+			unsigned int hash = ((data[i] << 16 | data[i + 1] << 8 | data[i + 2]) * 2654435761u) >> (32 - ESTIMATE_HASH_BITS);
+			int prev = windowStart + head[hash] - 1;
+			int matched = head[hash] != 0 && i - prev <= ESTIMATE_BLOCK_SIZE && memcmp(data + prev, data + i, 3) == 0;
+			if (matched) nCovered += inRun ? 1 : 3;
+			inRun = matched;
+			head[hash] = (unsigned short) (i - windowStart + 1);
+		}
+	}
+
+	unsigned int nSampled = 0;
+	int nSymbols = 0;
+	for (int i = 0; i < 256; i++) {
+		nSampled += histogram[i];
+		if (histogram[i]) nSymbols++;
+	}
+	estimate->nSampled = nSampled;
+	estimate->nSymbols = nSymbols;
+	estimate->entropy = nSampled ? entropyOf(histogram, 256, nSampled) : 0.0;
+	estimate->nibbleEntropy = nSampled ? entropyOf(nibbles, 16, nSampled * 2) : 0.0;
+	estimate->matchDensity = nPositions ? (double) (nCovered < nPositions ? nCovered : nPositions) / nPositions : 0.0;
+}
+
+int estimateCompressedSize(const COMPRESSIONESTIMATE *estimate, int size, int compression) {
+	double predicted = size;
+	switch (compression) {
 		case COMPRESSION_LZ77:
-			return lz77compress(buffer, size, compressedSize);
 		case COMPRESSION_LZ11:
-			return lz11compress(buffer, size, compressedSize);
-		case COMPRESSION_HUFFMAN_4:
-			return huffman4Compress(buffer, size, compressedSize); //Commented out because 
-		case COMPRESSION_HUFFMAN_8:
-			return huffman8Compress(buffer, size, compressedSize);
 		case COMPRESSION_LZ77_HEADER:
-			return lz77HeaderCompress(buffer, size, compressedSize);
+		{
+			//a literal costs a byte and a flag bit. Repeated bytes are taken to cost nothing, so the
+			//prediction is a lower bound and only data with next to no repeats is predicted to grow.
+			predicted = 4 + size * (1.0 - estimate->matchDensity) * 9.0 / 8.0;
+			if (compression == COMPRESSION_LZ77_HEADER) predicted += 4;
+			break;
+		}
+		case COMPRESSION_HUFFMAN_8:
+			//the tree takes about two bytes per symbol.
+			predicted = 4 + 2 * estimate->nSymbols + size * estimate->entropy / 8.0;
+			break;
+		case COMPRESSION_HUFFMAN_4:
+			predicted = 4 + 32 + size * estimate->nibbleEntropy / 4.0;
+			break;
+		case COMPRESSION_AUTO:
+		{
+			int candidates[COMPRESSION_MAX_AUTO_CANDIDATES];
+			int nCandidates = getAutoCandidates(size, candidates);
+			int best = size;
+			for (int i = 1; i < nCandidates; i++) {
+				int candidateSize = estimateCompressedSize(estimate, size, candidates[i]);
+				if (candidateSize < best) best = candidateSize;
+			}
+			return best;
+		}
 	}
-	return NULL;
+	return predicted > INT_MAX ? INT_MAX : (int) predicted;
+}
+
+void getCompressionCounters(COMPRESSIONCOUNTERS *out) {
+#ifndef COMPRESSION_NO_COUNTERS
+	*out = counters;
+#else
+	memset(out, 0, sizeof(COMPRESSIONCOUNTERS));
+#endif
+}
+
+void resetCompressionCounters(void) {
+#ifndef COMPRESSION_NO_COUNTERS
+	memset(&counters, 0, sizeof(COMPRESSIONCOUNTERS));
+#endif
 }
 
 const char *getCompressionTypeName(int type)
@@ -855,6 +2225,9 @@ const char *getCompressionTypeName(int type)
 			
 		case COMPRESSION_LZ77_HEADER:
 			return "COMPRESSION_LZ77_HEADER";
+
+		case COMPRESSION_AUTO:
+			return "COMPRESSION_AUTO";
 		
 		default:
 			return "COMPRESSION_NONE";
@@ -873,6 +2246,8 @@ int getCompressionTypeId(const char *name)
 		return COMPRESSION_HUFFMAN_8;
 	} else if (!strcmp("COMPRESSION_LZ77_HEADER", name)) {
 		return COMPRESSION_LZ77_HEADER;
+	} else if (!strcmp("COMPRESSION_AUTO", name)) {
+		return COMPRESSION_AUTO;
 	} else {
 		return COMPRESSION_NONE;
 	}
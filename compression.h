@@ -1,11 +1,88 @@
 #pragma once
 
+#include <stdint.h>
+
 #define COMPRESSION_NONE             0
 #define COMPRESSION_LZ77             1
 #define COMPRESSION_LZ11             2
 #define COMPRESSION_HUFFMAN_4        3
 #define COMPRESSION_HUFFMAN_8        4
 #define COMPRESSION_LZ77_HEADER      5
+#define COMPRESSION_AUTO             6 //tries every codec that can hold the data and keeps the smallest result
+
+#define COMPRESSION_MAX_AUTO_CANDIDATES 5
+
+#define COMPRESSION_LEVEL_FAST       0 //greedy parsing with a shallow match search
+#define COMPRESSION_LEVEL_NORMAL     1 //greedy parsing with a full match search
+#define COMPRESSION_LEVEL_LAZY       2 //lazy matching: defer a match when the next byte starts a longer one
+#define COMPRESSION_LEVEL_OPTIMAL    3 //price-based optimal parsing; smallest output
+#define COMPRESSION_LEVEL_DEFAULT    COMPRESSION_LEVEL_NORMAL
+
+#define COMPRESSION_LENGTH_BUCKETS   17 //match length histogram buckets; bucket b holds lengths 2^b to 2^(b+1)-1
+
+//Hot-path counters of the codecs, accumulated per thread. Building compression.c with
+//COMPRESSION_NO_COUNTERS defined compiles them out, and they then always read as zero.
+typedef struct COMPRESSIONCOUNTERS_ {
+	unsigned long long nSearches; //LZ match searches
+	unsigned long long nCandidates; //candidate positions probed by the LZ match finders
+	unsigned long long nBytesCompared; //bytes compared while probing candidates
+	unsigned long long nLiterals; //literal tokens emitted by the LZ compressors
+	unsigned long long nMatches; //match tokens emitted by the LZ compressors
+	unsigned long long matchLengths[COMPRESSION_LENGTH_BUCKETS]; //histogram of emitted match lengths
+	unsigned long long nDecodedLiterals; //literal tokens read by the LZ decoders
+	unsigned long long nDecodedMatches; //match tokens read by the LZ decoders
+	unsigned long long nValidatorPasses; //format checks run by getCompressionType and decompressDetect
+} COMPRESSIONCOUNTERS;
+
+//An output size limit for compressBounded. It is polled while compressing, so it may shrink as
+//other work finishes (for instance other candidates of COMPRESSION_AUTO running on other threads).
+typedef struct COMPRESSIONBOUND_ {
+	int (*getMaxSize) (void *param); //largest compressed size still worth producing
+	void *param;
+} COMPRESSIONBOUND;
+
+//A quick look at how compressible a buffer is, taken from samples of it by estimateCompression.
+typedef struct COMPRESSIONESTIMATE_ {
+	double entropy; //order-0 entropy of the sampled bytes, in bits per byte
+	double nibbleEntropy; //order-0 entropy of the sampled nibbles, in bits per nibble
+	double matchDensity; //fraction of sampled bytes in repeats, of 3 or more bytes, of ones in the 4KB before them
+	int nSymbols; //distinct byte values seen
+	int nSampled; //bytes looked at
+} COMPRESSIONESTIMATE;
+
+#define DECOMPRESSION_STREAM_WINDOW  0x1000 //history kept by a stream; as far back as an LZ match reaches
+#define DECOMPRESSION_STREAM_INPUT   0x100 //input a stream buffers between decompressStreamFeed and decompressStreamDrain
+
+//State of a streaming decoder, for decoding data a piece at a time without holding all of it. It
+//takes a fixed few kilobytes whatever the size of the data. Its fields are internal to compression.c.
+typedef struct DECOMPRESSIONSTREAM_ {
+	int compression; //type of compression being decoded
+	int state; //what the decoder expects next
+	int error; //set once malformed data has been seen
+	uint32_t length; //uncompressed size, once the header has been read
+	uint32_t nDecoded; //bytes of output produced so far
+	unsigned char input[DECOMPRESSION_STREAM_INPUT];
+	int inputStart, inputEnd; //part of input fed but not decoded yet
+
+	//LZ decoding
+	unsigned char window[DECOMPRESSION_STREAM_WINDOW]; //the last bytes of output, indexed by position
+	unsigned char flags; //flag byte of the current group of tokens
+	int nFlags; //tokens left in the current group
+	uint32_t matchOffs, matchLen; //match still being copied out
+
+	//Huffman decoding
+	unsigned char tree[512];
+	int treeSize, nTreeRead;
+	int symSize; //bits per symbol, 4 or 8
+	uint32_t bits; //the current word of the bit stream, next bit first
+	int nBits; //bits left in it
+	int node; //tree offset reached by the code being read
+	unsigned char partial; //nibbles of a byte not complete yet
+	int nPartial;
+} DECOMPRESSIONSTREAM;
+
+//State of a streaming compressor, created by compressStreamCreate. Internal to compression.c.
+typedef struct COMPRESSIONSTREAM_ COMPRESSIONSTREAM;
 
 #ifdef __cplusplus
 extern "C" {
@@ -38,12 +115,13 @@ char *lz77decompress(char *buffer, int size, unsigned int *uncompressedSize);
 *	buffer					the buffer to compress
 *	size					size of the buffer
 *	compressedSize			pointer that receives the compressed size
+*	level					compression effort, one of the COMPRESSION_LEVEL_* values
 *
 * Returns:
 *	A pointer to the compressed buffer on success, or NULL on failure.
 *
 \******************************************************************************/
-char *lz77compress(char *buffer, int size, unsigned int *compressedSize);
+char *lz77compress(char *buffer, int size, unsigned int *compressedSize, int level);
 
 
 /******************************************************************************\
@@ -89,12 +167,13 @@ char *lz11decompress(char *buffer, int size, int *uncompressedSize);
 *	buffer					the buffer to compress
 *	size					size of the buffer
 *	compressedSize			pointer that receives the compressed size
+*	level					compression effort, one of the COMPRESSION_LEVEL_* values
 *
 * Returns:
 *	A pointer to the compressed buffer on success, or NULL on failure.
 *
 \******************************************************************************/
-char *lz11compress(char *buffer, int size, int *compressedSize);
+char *lz11compress(char *buffer, int size, int *compressedSize, int level);
 
 
 /******************************************************************************\
@@ -196,12 +275,13 @@ char *lz77HeaderDecompress(char *buffer, int size, int *uncompressedSize);
 *	buffer					the buffer to compress
 *	size					size of the buffer
 *	compressedSize			pointer that receives the compressed size
+*	level					compression effort, one of the COMPRESSION_LEVEL_* values
 *
 * Returns:
 *	A pointer to the compressed buffer on success, or NULL on failure.
 *
 \******************************************************************************/
-char *lz77HeaderCompress(char *buffer, int size, int *compressedSize);
+char *lz77HeaderCompress(char *buffer, int size, int *compressedSize, int level);
 
 
 /******************************************************************************\
@@ -219,6 +299,166 @@ char *lz77HeaderCompress(char *buffer, int size, int *compressedSize);
 \******************************************************************************/
 int lz77HeaderIsCompressed(unsigned char *buffer, unsigned size);
 
+//----- Streaming decompression
+
+/******************************************************************************\
+*
+* Starts decoding a stream of compressed data. Feed it input with
+* decompressStreamFeed, take the output with decompressStreamDrain, and check
+* that it all arrived with decompressStreamFinish. Nothing is allocated.
+*
+* Parameters:
+*	stream					the stream to set up
+*	compression				the type of compression on the data: LZ77, LZ11,
+*							LZ77_HEADER, or either Huffman type
+*
+* Returns:
+*	1 on success, or 0 if the compression type can't be streamed.
+*
+\******************************************************************************/
+int decompressStreamInit(DECOMPRESSIONSTREAM *stream, int compression);
+
+/******************************************************************************\
+*
+* Gives a stream more compressed data. Only as much as fits in its input
+* buffer is taken, so drain it and feed the rest again. Once all the output
+* has been decoded, further input (padding) is accepted and ignored.
+*
+* Parameters:
+*	stream					the stream
+*	input					the next compressed bytes
+*	size					number of bytes in input
+*
+* Returns:
+*	The number of bytes taken from input.
+*
+\******************************************************************************/
+int decompressStreamFeed(DECOMPRESSIONSTREAM *stream, const char *input, int size);
+
+/******************************************************************************\
+*
+* Decodes as much of the input fed so far as fits in an output buffer.
+*
+* Parameters:
+*	stream					the stream
+*	output					buffer receiving decoded bytes
+*	size					size of the output buffer
+*
+* Returns:
+*	The number of bytes written; 0 means more input is needed or the data is
+*	all decoded. -1 if the data is malformed.
+*
+\******************************************************************************/
+int decompressStreamDrain(DECOMPRESSIONSTREAM *stream, char *output, int size);
+
+/******************************************************************************\
+*
+* Gets the uncompressed size of a stream's data.
+*
+* Parameters:
+*	stream					the stream
+*
+* Returns:
+*	The uncompressed size, or -1 if the header has not been fed yet.
+*
+\******************************************************************************/
+int decompressStreamGetSize(const DECOMPRESSIONSTREAM *stream);
+
+/******************************************************************************\
+*
+* Checks how a stream ended.
+*
+* Parameters:
+*	stream					the stream
+*
+* Returns:
+*	1 if all the data was decoded and drained, or 0 if the data was malformed
+*	or ended early.
+*
+\******************************************************************************/
+int decompressStreamFinish(DECOMPRESSIONSTREAM *stream);
+
+//----- Streaming compression
+
+/******************************************************************************\
+*
+* Starts compressing data that arrives a piece at a time. Feed it input with
+* compressStreamFeed, take the output with compressStreamDrain, check that it
+* all came out with compressStreamFinish, and release it with
+* compressStreamFree. Only the LZ window, some input ahead of it and the match
+* finder are kept, and the output is the same as compress would give.
+*
+* Parameters:
+*	compression				the type of compression to use: LZ77, LZ11 or
+*							LZ77_HEADER. Huffman codes depend on all of the
+*							data, so they can't be streamed.
+*	size					the size of all of the data, which goes in the
+*							header
+*	level					compression effort, one of the COMPRESSION_LEVEL_* values
+*
+* Returns:
+*	The new stream, or NULL if the type can't be streamed, the size doesn't fit
+*	the header, or memory could not be allocated.
+*
+\******************************************************************************/
+COMPRESSIONSTREAM *compressStreamCreate(int compression, int size, int level);
+
+/******************************************************************************\
+*
+* Gives a stream more data to compress. Only as much as fits in its buffer is
+* taken, so drain it and feed the rest again. Data past the size given to
+* compressStreamCreate is not taken.
+*
+* Parameters:
+*	stream					the stream
+*	input					the next bytes of data
+*	size					number of bytes in input
+*
+* Returns:
+*	The number of bytes taken from input.
+*
+\******************************************************************************/
+int compressStreamFeed(COMPRESSIONSTREAM *stream, const char *input, int size);
+
+/******************************************************************************\
+*
+* Compresses what the data fed so far allows, into an output buffer.
+*
+* Parameters:
+*	stream					the stream
+*	output					buffer receiving compressed bytes
+*	size					size of the output buffer
+*
+* Returns:
+*	The number of bytes written; 0 means more input is needed or the output
+*	is complete.
+*
+\******************************************************************************/
+int compressStreamDrain(COMPRESSIONSTREAM *stream, char *output, int size);
+
+/******************************************************************************\
+*
+* Checks that all of a stream's output has been drained.
+*
+* Parameters:
+*	stream					the stream
+*
+* Returns:
+*	1 if all the data was fed, compressed and drained, or 0 otherwise.
+*
+\******************************************************************************/
+int compressStreamFinish(COMPRESSIONSTREAM *stream);
+
+/******************************************************************************\
+*
+* Frees a stream from compressStreamCreate.
+*
+* Parameters:
+*	stream					the stream, or NULL
+*
+\******************************************************************************/
+void compressStreamFree(COMPRESSIONSTREAM *stream);
+
 //----- Common functions
 
 /******************************************************************************\
@@ -252,6 +492,28 @@ int getCompressionType(char *buffer, int size);
 char *decompress(char *buffer, int size, int *uncompressedSize);
 
 
+/******************************************************************************\
+*
+* Decompresses a buffer in a single pass, detecting the type of compression
+* from its first byte and validating the data while decoding it. Accepts
+* exactly the data getCompressionType would identify.
+*
+* Parameters:
+*	buffer					the buffer to decompress
+*	size					the size of the buffer
+*	uncompressedSize		pointer receiving the uncompressed size
+*	compressionType			pointer receiving the detected compression type
+*
+* Returns:
+*	A buffer containing the decompressed data, or NULL if the data is not
+*	compressed (compressionType is then COMPRESSION_NONE and the data can be
+*	used as is) or memory could not be allocated (compressionType is then
+*	the detected type, and the data must not be used as is).
+*
+\******************************************************************************/
+char *decompressDetect(char *buffer, int size, int *uncompressedSize, int *compressionType);
+
+
 /******************************************************************************\
 *
 * Compresses a buffer with the compression algorithm of choice.
@@ -261,12 +523,81 @@ char *decompress(char *buffer, int size, int *uncompressedSize);
 *	size					the size of the buffer
 *	compression				the type of compression to use
 *	compressedSize			pointer receiving the uncompressed size
+*	level					compression effort, one of the COMPRESSION_LEVEL_* values;
+*							ignored by the Huffman compressors
 *
 * Returns:
 *	A buffer containing the compressed data.
 *
 \******************************************************************************/
-char *compress(char *buffer, int size, int compression, int *compressedSize);
+char *compress(char *buffer, int size, int compression, int *compressedSize, int level);
+
+/******************************************************************************\
+*
+* Compresses a buffer like compress, but gives up as soon as the output grows
+* past the size a bound allows.
+*
+* Parameters:
+*	buffer					the buffer to compress
+*	size					the size of the buffer
+*	compression				the type of compression to use
+*	compressedSize			pointer receiving the compressed size
+*	level					compression effort, one of the COMPRESSION_LEVEL_* values
+*	bound					the size limit, or NULL for none
+*
+* Returns:
+*	A buffer containing the compressed data, or NULL if it would not fit the
+*	bound or compression failed.
+*
+\******************************************************************************/
+char *compressBounded(char *buffer, int size, int compression, int *compressedSize, int level, const COMPRESSIONBOUND *bound);
+
+/******************************************************************************\
+*
+* Gets the codecs COMPRESSION_AUTO tries for a buffer, in order of preference:
+* when two give the same size, the earlier one is kept.
+*
+* Parameters:
+*	size					the size of the buffer to compress
+*	candidates				array of COMPRESSION_MAX_AUTO_CANDIDATES receiving
+*							the compression types
+*
+* Returns:
+*	The number of candidates. COMPRESSION_NONE is always the first.
+*
+\******************************************************************************/
+int getAutoCandidates(int size, int *candidates);
+
+/******************************************************************************\
+*
+* Estimates how well a buffer compresses from evenly spaced 4KB samples of it,
+* at a small fraction of the cost of compressing it.
+*
+* Parameters:
+*	buffer					the buffer to look at
+*	size					the size of the buffer
+*	estimate				pointer receiving the estimate
+*
+\******************************************************************************/
+void estimateCompression(char *buffer, int size, COMPRESSIONESTIMATE *estimate);
+
+/******************************************************************************\
+*
+* Predicts the compressed size of a buffer from its estimate. The prediction
+* is rough and errs low, so a size not smaller than the buffer means the
+* codec is all but certain not to shrink it.
+*
+* Parameters:
+*	estimate				the estimate from estimateCompression
+*	size					the size of the buffer
+*	compression				the type of compression
+*
+* Returns:
+*	The predicted compressed size. For COMPRESSION_AUTO, the smallest size
+*	predicted for any of its candidates.
+*
+\******************************************************************************/
+int estimateCompressedSize(const COMPRESSIONESTIMATE *estimate, int size, int compression);
 
 /******************************************************************************\
 *
@@ -294,6 +625,26 @@ const char *getCompressionTypeName(int type);
 \******************************************************************************/
 int getCompressionTypeId(const char *name);
 
+
+/******************************************************************************\
+*
+* Gets the codec counters of the calling thread, accumulated since the last
+* call to resetCompressionCounters on the same thread.
+*
+* Parameters:
+*	counters				pointer receiving the counters
+*
+\******************************************************************************/
+void getCompressionCounters(COMPRESSIONCOUNTERS *counters);
+
+
+/******************************************************************************\
+*
+* Resets the codec counters of the calling thread to zero.
+*
+\******************************************************************************/
+void resetCompressionCounters(void);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
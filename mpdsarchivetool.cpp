@@ -3,14 +3,32 @@
 #include <fstream>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
 #if defined(_WIN32)
 #include <direct.h>
+#include <sys/utime.h>
+#include <windows.h>
 #else
-#include <sys/stat.h>
+#include <dirent.h>
+#include <utime.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #endif
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
 #include <exception>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include "compression.h"
 
 bool MakeDirectory(const char *dir)
@@ -24,23 +42,1071 @@ bool MakeDirectory(const char *dir)
     return ret != -1 || errno == EEXIST;
 }
 
-char *ReadDataFile(const char *path, int &size)
+int GetCurrentPid()
+{
+#if defined(_WIN32)
+    return (int)GetCurrentProcessId();
+#else
+    return (int)getpid();
+#endif
+}
+
+char *ReadDataFile(const char *path, int &size)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    char *buffer = (char *)malloc(size);
+    fseek(file, 0, SEEK_SET);
+    int nbytes = fread(buffer, 1, size, file);
+    fclose(file);
+    if (size != nbytes) {
+        free(buffer);
+        return NULL;
+    }
+    return buffer;
+}
+
+//Read-only view of a whole file. Memory-mapped where possible, otherwise read into the heap
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    bool Open(const char *path)
+    {
+        Close();
+        if (!Map(path)) {
+            m_data = ReadDataFile(path, m_size);
+        }
+        return m_data != NULL;
+    }
+
+    void Close()
+    {
+        if (m_mapped) {
+#if defined(_WIN32)
+            UnmapViewOfFile(m_data);
+#else
+            munmap(m_data, m_size);
+#endif
+        } else {
+            free(m_data);
+        }
+        m_data = NULL;
+        m_size = 0;
+        m_mapped = false;
+    }
+
+    char *GetData()
+    {
+        return m_data;
+    }
+
+    int GetSize()
+    {
+        return m_size;
+    }
+
+private:
+    bool Map(const char *path)
+    {
+        int64_t size;
+#if defined(_WIN32)
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || !CanMap(file_size.QuadPart)) {
+            CloseHandle(file);
+            return false;
+        }
+        size = file_size.QuadPart;
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(file);
+        if (!mapping) {
+            return false;
+        }
+        void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (!data) {
+            return false;
+        }
+#else
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !CanMap(info.st_size)) {
+            close(fd);
+            return false;
+        }
+        size = info.st_size;
+        void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+#endif
+        m_data = (char *)data;
+        m_size = (int)size;
+        m_mapped = true;
+        return true;
+    }
+
+    static bool CanMap(int64_t size)
+    {
+        //Empty files can't be mapped, and the codecs take sizes as an int
+        return size > 0 && size <= 0x7FFFFFFF;
+    }
+
+    char *m_data = NULL;
+    int m_size = 0;
+    bool m_mapped = false;
+};
+
+long GetFileSize(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+struct TaskGroup {
+    std::atomic<int> m_pending{0};
+};
+
+//A work-stealing pool: every thread has its own queue, which it takes jobs from first, and other
+//threads steal from when theirs runs dry. Jobs submitted from inside a job therefore stay close to
+//the thread waiting on them, so nested work (archives, then their entries) is finished promptly
+class ThreadPool {
+public:
+    //num_threads counts the calling thread, which runs jobs while it waits
+    ThreadPool(int num_threads) : m_queues(num_threads)
+    {
+        for (int i = 1; i < num_threads; i++) {
+            m_threads.push_back(std::thread(&ThreadPool::WorkerMain, this, i));
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            m_stop = true;
+        }
+        m_work_cv.notify_all();
+        for (size_t i = 0; i < m_threads.size(); i++) {
+            m_threads[i].join();
+        }
+    }
+
+    //Queue a job on the current thread's queue; other threads steal its jobs in the order they are submitted
+    void Submit(TaskGroup &group, std::function<void()> func)
+    {
+        group.m_pending++;
+        Queue &queue = m_queues[CurrentQueue()];
+        {
+            std::lock_guard<std::mutex> lock(queue.m_mutex);
+            queue.m_jobs.push_back(Job{ func, &group });
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            m_num_queued++;
+        }
+        m_work_cv.notify_one();
+    }
+
+    //Run the jobs of group on this thread until every one of them has finished. Only that group's
+    //jobs are taken, newest first, so a job waiting here never starts an unrelated job that might
+    //wait in turn and nest ever deeper on this thread's stack
+    void Wait(TaskGroup &group)
+    {
+        int index = CurrentQueue();
+        while (group.m_pending > 0) {
+            if (RunJob(index, &group)) {
+                continue;
+            }
+            //The rest were stolen; only this thread adds to its queue, so nothing new can show up
+            std::unique_lock<std::mutex> lock(m_sleep_mutex);
+            m_done_cv.wait(lock, [&]() {
+                return group.m_pending == 0;
+            });
+        }
+    }
+
+private:
+    struct Job {
+        std::function<void()> m_func;
+        TaskGroup *m_group;
+    };
+
+    struct Queue {
+        std::deque<Job> m_jobs;
+        std::mutex m_mutex;
+    };
+
+    //Index of the queue owned by the calling thread; threads outside the pool share the first one
+    int CurrentQueue()
+    {
+        return t_pool == this ? t_queue_index : 0;
+    }
+
+    //With a group, only the newest job of this thread's own queue is taken, and only if it is in that group
+    bool TakeJob(int index, Job &job, TaskGroup *group)
+    {
+        if (group) {
+            Queue &queue = m_queues[index];
+            std::lock_guard<std::mutex> lock(queue.m_mutex);
+            if (queue.m_jobs.empty() || queue.m_jobs.back().m_group != group) {
+                return false;
+            }
+            job = queue.m_jobs.back();
+            queue.m_jobs.pop_back();
+            m_num_queued--;
+            return true;
+        }
+        for (size_t i = 0; i < m_queues.size(); i++) {
+            Queue &queue = m_queues[(index + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(queue.m_mutex);
+            if (!queue.m_jobs.empty()) {
+                job = queue.m_jobs.front();
+                queue.m_jobs.pop_front();
+                m_num_queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool RunJob(int index, TaskGroup *group = NULL)
+    {
+        Job job;
+        if (!TakeJob(index, job, group)) {
+            return false;
+        }
+        job.m_func();
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            job.m_group->m_pending--;
+        }
+        m_done_cv.notify_all();
+        return true;
+    }
+
+    void WorkerMain(int index)
+    {
+        t_pool = this;
+        t_queue_index = index;
+        while (true) {
+            if (RunJob(index)) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(m_sleep_mutex);
+            m_work_cv.wait(lock, [&]() {
+                return m_num_queued > 0 || m_stop;
+            });
+            if (m_num_queued == 0 && m_stop) {
+                return;
+            }
+        }
+    }
+
+    static thread_local ThreadPool *t_pool;
+    static thread_local int t_queue_index;
+
+    std::vector<std::thread> m_threads;
+    std::vector<Queue> m_queues;
+    std::atomic<int> m_num_queued{0};
+    std::mutex m_sleep_mutex;
+    //Idle workers wait for new jobs, and threads in Wait for jobs to finish, on separate variables so
+    //that a wakeup meant for one kind is never used up by the other
+    std::condition_variable m_work_cv;
+    std::condition_variable m_done_cv;
+    bool m_stop = false;
+};
+
+thread_local ThreadPool *ThreadPool::t_pool = NULL;
+thread_local int ThreadPool::t_queue_index = 0;
+
+//Bump whenever a compressor's output changes so stale cache entries are not reused
+#define CACHE_VERSION 3
+
+void ListDirectory(std::string dir, std::vector<std::string> &names)
+{
+#if defined(_WIN32)
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((dir + "/*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    do {
+        if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            names.push_back(data.cFileName);
+        }
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+#else
+    DIR *handle = opendir(dir.c_str());
+    if (!handle) {
+        return;
+    }
+    while (struct dirent *entry = readdir(handle)) {
+        if (entry->d_name[0] != '.') {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(handle);
+#endif
+}
+
+uint64_t HashData(const char *data, int size, uint64_t seed, uint64_t prime)
+{
+    //FNV-1a style hash; called twice with different constants for a 128-bit key
+    uint64_t hash = seed;
+    for (int i = 0; i < size; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= prime;
+    }
+    return hash;
+}
+
+class CompressionCache {
+public:
+    CompressionCache(std::string dir, uint64_t max_size)
+        : m_dir(dir), m_max_size(max_size)
+    {
+    }
+
+    bool Init()
+    {
+        return MakeDirectory(m_dir.c_str());
+    }
+
+    std::string GetKey(const char *data, int size, int compression_type, int compression_level)
+    {
+        char key[96];
+        uint64_t hash_a = HashData(data, size, 0xCBF29CE484222325ULL, 0x100000001B3ULL);
+        uint64_t hash_b = HashData(data, size, 0x84222325CBF29CE4ULL, 0x9E3779B97F4A7C15ULL);
+        snprintf(key, sizeof(key), "%016llx%016llx_%d_%d_%d_v%d.bin", (unsigned long long)hash_a, (unsigned long long)hash_b,
+            size, compression_type, compression_level, CACHE_VERSION);
+        return key;
+    }
+
+    //Returns a malloc'd copy of the cached compressed data, or NULL on a miss
+    char *Load(std::string key, int &size)
+    {
+        std::string path = m_dir + "/" + key;
+        char *buffer = ReadDataFile(path.c_str(), size);
+        if (buffer) {
+            //Mark as recently used for trimming
+            utime(path.c_str(), NULL);
+        }
+        return buffer;
+    }
+
+    void Store(std::string key, const char *data, int size)
+    {
+        //Write to a temporary name first so a concurrent reader never sees a partial file. The name is
+        //unique to this call, so neither another thread nor another process sharing the cache clobbers it
+        std::string path = m_dir + "/" + key;
+        std::string temp_path = path + "." + std::to_string(GetCurrentPid()) + "." + std::to_string(m_num_stored++) + ".tmp";
+        FILE *file = fopen(temp_path.c_str(), "wb");
+        if (!file) {
+            return;
+        }
+        bool ok = fwrite(data, 1, size, file) == (size_t)size;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+            remove(temp_path.c_str());
+        }
+    }
+
+    //Delete least recently used entries until the cache fits in its size limit
+    void Trim()
+    {
+        std::vector<std::string> names;
+        std::vector<std::pair<time_t, std::string>> entries;
+        uint64_t total_size = 0;
+        ListDirectory(m_dir, names);
+        for (size_t i = 0; i < names.size(); i++) {
+            std::string path = m_dir + "/" + names[i];
+            struct stat info;
+            if (stat(path.c_str(), &info) == 0) {
+                total_size += info.st_size;
+                entries.push_back(std::make_pair(info.st_mtime, path));
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+        for (size_t i = 0; i < entries.size() && total_size > m_max_size; i++) {
+            struct stat info;
+            if (stat(entries[i].second.c_str(), &info) == 0 && remove(entries[i].second.c_str()) == 0) {
+                total_size -= info.st_size;
+            }
+        }
+    }
+
+private:
+    std::string m_dir;
+    uint64_t m_max_size;
+    std::atomic<uint64_t> m_num_stored{0};
+};
+
+double GetTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string EscapeJsonString(std::string str)
+{
+    std::string escaped;
+    for (size_t i = 0; i < str.size(); i++) {
+        char c = str[i];
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if ((unsigned char)c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+//Every field of the codec counters is an unsigned long long, so they can be added up as an array
+#define NUM_COUNTERS (sizeof(COMPRESSIONCOUNTERS) / sizeof(unsigned long long))
+
+void AddCounters(COMPRESSIONCOUNTERS &total, const COMPRESSIONCOUNTERS &counters)
+{
+    unsigned long long *dst = (unsigned long long *)&total;
+    const unsigned long long *src = (const unsigned long long *)&counters;
+    for (size_t i = 0; i < NUM_COUNTERS; i++) {
+        dst[i] += src[i];
+    }
+}
+
+//Measures what the codecs do on the calling thread between construction and Get
+class CounterSpan {
+public:
+    CounterSpan()
+    {
+        getCompressionCounters(&m_start);
+    }
+
+    COMPRESSIONCOUNTERS Get()
+    {
+        COMPRESSIONCOUNTERS counters;
+        getCompressionCounters(&counters);
+        unsigned long long *dst = (unsigned long long *)&counters;
+        const unsigned long long *start = (const unsigned long long *)&m_start;
+        for (size_t i = 0; i < NUM_COUNTERS; i++) {
+            dst[i] -= start[i];
+        }
+        return counters;
+    }
+
+private:
+    COMPRESSIONCOUNTERS m_start;
+};
+
+//What the codec calls made for one buffer cost, whichever threads they ran on
+struct CodecWork {
+    double m_seconds = 0;
+    COMPRESSIONCOUNTERS m_counters{};
+
+    void Add(double seconds, const COMPRESSIONCOUNTERS &counters)
+    {
+        m_seconds += seconds;
+        AddCounters(m_counters, counters);
+    }
+};
+
+//Outcome of the pre-scan that guesses whether an entry will shrink before it is compressed
+struct PreScan {
+    bool m_done = false;
+    COMPRESSIONESTIMATE m_estimate;
+    int m_predicted_size = 0;
+    bool m_loss = false; //the requested codec is predicted not to shrink the entry
+    bool m_stored = false; //and the entry was stored as is instead
+};
+
+//Number of entries listed by the slowest entry report
+#define STATS_NUM_SLOWEST 10
+//Every type a codec call can be made with, COMPRESSION_AUTO included
+#define STATS_NUM_TYPES (COMPRESSION_AUTO + 1)
+
+//Timings and sizes gathered while processing, reported with --stats and --stats-json. Phases are
+//wall time; codec and entry times are summed over every thread, so they can exceed the phase
+//they ran in. Safe to update from any thread
+class Stats {
+public:
+    Stats()
+    {
+        for (int i = 0; i < STATS_NUM_TYPES; i++) {
+            m_compress[i].m_name = getCompressionTypeName(i);
+            m_decompress[i].m_name = getCompressionTypeName(i);
+        }
+    }
+
+    //Phases of the same name, e.g. of several archives in a batch, are added together
+    void AddPhase(std::string name, double seconds, uint64_t bytes_in, uint64_t bytes_out)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t index = 0;
+        while (index < m_phases.size() && m_phases[index].m_name != name) {
+            index++;
+        }
+        if (index == m_phases.size()) {
+            m_phases.push_back(Totals());
+            m_phases[index].m_name = name;
+        }
+        m_phases[index].Add(seconds, bytes_in, bytes_out);
+    }
+
+    void AddCodecCall(bool compress, int compression_type, double seconds, uint64_t bytes_in, uint64_t bytes_out)
+    {
+        if (compression_type < 0 || compression_type >= STATS_NUM_TYPES) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        (compress ? m_compress : m_decompress)[compression_type].Add(seconds, bytes_in, bytes_out);
+    }
+
+    void AddCounters(const COMPRESSIONCOUNTERS &counters)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ::AddCounters(m_counters, counters);
+    }
+
+    //The match finder counters are kept with each entry to tell why it was slow
+    void AddEntry(std::string name, int compression_type, double seconds, uint64_t raw_size, uint64_t packed_size, const COMPRESSIONCOUNTERS &counters,
+        const PreScan *scan = NULL)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_slowest.size() == STATS_NUM_SLOWEST && seconds <= m_slowest.back().m_seconds) {
+            return;
+        }
+        EntryTime entry = { name, compression_type, seconds, raw_size, packed_size, counters.nCandidates, counters.nBytesCompared, PreScan() };
+        if (scan) {
+            entry.m_scan = *scan;
+        }
+        auto pos = std::upper_bound(m_slowest.begin(), m_slowest.end(), entry, [](const EntryTime &a, const EntryTime &b) {
+            return a.m_seconds > b.m_seconds;
+        });
+        m_slowest.insert(pos, entry);
+        if (m_slowest.size() > STATS_NUM_SLOWEST) {
+            m_slowest.pop_back();
+        }
+    }
+
+    void AddPreScan(double seconds, uint64_t size, const PreScan &scan)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_prescan.Add(seconds, size, scan.m_estimate.nSampled);
+        m_num_losses += scan.m_loss;
+        m_num_stored += scan.m_stored;
+    }
+
+    void SetTotalTime(double seconds)
+    {
+        m_total_seconds = seconds;
+    }
+
+    void Print()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        printf("Total time: %.4f s\n\n", m_total_seconds);
+        printf("%-44s %6s %10s %12s %12s\n", "Phase", "Count", "Seconds", "Bytes in", "Bytes out");
+        for (size_t i = 0; i < m_phases.size(); i++) {
+            const Totals &phase = m_phases[i];
+            printf("%-44s %6llu %10.4f %12llu %12llu\n", phase.m_name.c_str(), (unsigned long long)phase.m_count, phase.m_seconds,
+                (unsigned long long)phase.m_bytes_in, (unsigned long long)phase.m_bytes_out);
+        }
+        printf("\n%-24s %-10s %6s %10s %12s %12s %7s %9s\n", "Codec", "Operation", "Calls", "Seconds", "Bytes in", "Bytes out", "Ratio", "MB/s");
+        for (int compress = 1; compress >= 0; compress--) {
+            for (int i = 0; i < STATS_NUM_TYPES; i++) {
+                const Totals &codec = (compress ? m_compress : m_decompress)[i];
+                if (codec.m_count != 0) {
+                    printf("%-24s %-10s %6llu %10.4f %12llu %12llu %7.4f %9.2f\n", codec.m_name.c_str(), compress ? "compress" : "decompress",
+                        (unsigned long long)codec.m_count, codec.m_seconds, (unsigned long long)codec.m_bytes_in, (unsigned long long)codec.m_bytes_out,
+                        GetRatio(codec, compress), GetThroughput(codec, compress));
+                }
+            }
+        }
+        if (HasCounters()) {
+            printf("\n%-24s %14s\n", "Codec counters", "Count");
+            printf("%-24s %14llu\n", "Match searches", m_counters.nSearches);
+            printf("%-24s %14llu %8.2f per search\n", "Candidates probed", m_counters.nCandidates,
+                m_counters.nSearches ? (double)m_counters.nCandidates / m_counters.nSearches : 0);
+            printf("%-24s %14llu %8.2f per candidate\n", "Bytes compared", m_counters.nBytesCompared,
+                m_counters.nCandidates ? (double)m_counters.nBytesCompared / m_counters.nCandidates : 0);
+            printf("%-24s %14llu\n", "Literals emitted", m_counters.nLiterals);
+            printf("%-24s %14llu\n", "Matches emitted", m_counters.nMatches);
+            printf("%-24s %14llu\n", "Literals decoded", m_counters.nDecodedLiterals);
+            printf("%-24s %14llu\n", "Matches decoded", m_counters.nDecodedMatches);
+            printf("%-24s %14llu\n", "Validator passes", m_counters.nValidatorPasses);
+            printf("\n%-24s %14s\n", "Match length", "Matches");
+            for (int i = 0; i < COMPRESSION_LENGTH_BUCKETS; i++) {
+                if (m_counters.matchLengths[i] != 0) {
+                    char range[32];
+                    snprintf(range, sizeof(range), "%d-%d", 1 << i, (2 << i) - 1);
+                    printf("%-24s %14llu\n", range, m_counters.matchLengths[i]);
+                }
+            }
+        }
+        if (m_prescan.m_count != 0) {
+            printf("\n%-24s %6s %10s %12s %12s %9s %9s\n", "Pre-scan", "Count", "Seconds", "Bytes in", "Sampled", "Losses", "Stored");
+            printf("%-24s %6llu %10.4f %12llu %12llu %9llu %9llu\n", "Entries", (unsigned long long)m_prescan.m_count, m_prescan.m_seconds,
+                (unsigned long long)m_prescan.m_bytes_in, (unsigned long long)m_prescan.m_bytes_out, (unsigned long long)m_num_losses,
+                (unsigned long long)m_num_stored);
+        }
+        printf("\n%-44s %10s %-24s %12s %12s %14s %14s %8s %8s %12s\n", "Slowest entries", "Seconds", "Codec", "Raw size", "Packed size", "Probed", "Compared",
+            "Entropy", "Matches", "Predicted");
+        for (size_t i = 0; i < m_slowest.size(); i++) {
+            const EntryTime &entry = m_slowest[i];
+            printf("%-44s %10.4f %-24s %12llu %12llu %14llu %14llu", entry.m_name.c_str(), entry.m_seconds, getCompressionTypeName(entry.m_compression_type),
+                (unsigned long long)entry.m_raw_size, (unsigned long long)entry.m_packed_size, entry.m_candidates, entry.m_bytes_compared);
+            if (entry.m_scan.m_done) {
+                printf(" %8.3f %8.3f %12d\n", entry.m_scan.m_estimate.entropy, entry.m_scan.m_estimate.matchDensity, entry.m_scan.m_predicted_size);
+            } else {
+                printf(" %8s %8s %12s\n", "-", "-", "-");
+            }
+        }
+    }
+
+    bool WriteJson(std::string path)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        FILE *file = fopen(path.c_str(), "w");
+        if (!file) {
+            return false;
+        }
+        fprintf(file, "{\n\t\"totalSeconds\": %.6f,\n\t\"phases\": [", m_total_seconds);
+        for (size_t i = 0; i < m_phases.size(); i++) {
+            const Totals &phase = m_phases[i];
+            fprintf(file, "%s\n\t\t{ \"name\": \"%s\", \"count\": %llu, \"seconds\": %.6f, \"bytesIn\": %llu, \"bytesOut\": %llu }", i == 0 ? "" : ",",
+                EscapeJsonString(phase.m_name).c_str(), (unsigned long long)phase.m_count, phase.m_seconds,
+                (unsigned long long)phase.m_bytes_in, (unsigned long long)phase.m_bytes_out);
+        }
+        fprintf(file, "\n\t],\n\t\"codecs\": [");
+        bool first = true;
+        for (int compress = 1; compress >= 0; compress--) {
+            for (int i = 0; i < STATS_NUM_TYPES; i++) {
+                const Totals &codec = (compress ? m_compress : m_decompress)[i];
+                if (codec.m_count != 0) {
+                    fprintf(file, "%s\n\t\t{ \"codec\": \"%s\", \"operation\": \"%s\", \"calls\": %llu, \"seconds\": %.6f, \"bytesIn\": %llu, \"bytesOut\": %llu, "
+                        "\"ratio\": %.4f, \"MBs\": %.2f }", first ? "" : ",", codec.m_name.c_str(), compress ? "compress" : "decompress",
+                        (unsigned long long)codec.m_count, codec.m_seconds, (unsigned long long)codec.m_bytes_in, (unsigned long long)codec.m_bytes_out,
+                        GetRatio(codec, compress), GetThroughput(codec, compress));
+                    first = false;
+                }
+            }
+        }
+        fprintf(file, "\n\t],\n\t\"counters\": { \"searches\": %llu, \"candidates\": %llu, \"bytesCompared\": %llu, \"literals\": %llu, "
+            "\"matches\": %llu, \"decodedLiterals\": %llu, \"decodedMatches\": %llu, \"validatorPasses\": %llu, \"matchLengths\": [",
+            m_counters.nSearches, m_counters.nCandidates, m_counters.nBytesCompared, m_counters.nLiterals, m_counters.nMatches,
+            m_counters.nDecodedLiterals, m_counters.nDecodedMatches, m_counters.nValidatorPasses);
+        for (int i = 0; i < COMPRESSION_LENGTH_BUCKETS; i++) {
+            fprintf(file, "%s%llu", i == 0 ? "" : ", ", m_counters.matchLengths[i]);
+        }
+        fprintf(file, "] },\n\t\"preScan\": { \"entries\": %llu, \"seconds\": %.6f, \"bytesIn\": %llu, \"bytesSampled\": %llu, "
+            "\"predictedLosses\": %llu, \"stored\": %llu },\n\t\"slowestEntries\": [", (unsigned long long)m_prescan.m_count, m_prescan.m_seconds,
+            (unsigned long long)m_prescan.m_bytes_in, (unsigned long long)m_prescan.m_bytes_out, (unsigned long long)m_num_losses,
+            (unsigned long long)m_num_stored);
+        for (size_t i = 0; i < m_slowest.size(); i++) {
+            const EntryTime &entry = m_slowest[i];
+            fprintf(file, "%s\n\t\t{ \"name\": \"%s\", \"seconds\": %.6f, \"codec\": \"%s\", \"rawSize\": %llu, \"packedSize\": %llu, "
+                "\"candidates\": %llu, \"bytesCompared\": %llu", i == 0 ? "" : ",",
+                EscapeJsonString(entry.m_name).c_str(), entry.m_seconds, getCompressionTypeName(entry.m_compression_type),
+                (unsigned long long)entry.m_raw_size, (unsigned long long)entry.m_packed_size, entry.m_candidates, entry.m_bytes_compared);
+            if (entry.m_scan.m_done) {
+                fprintf(file, ", \"entropy\": %.4f, \"matchDensity\": %.4f, \"predictedSize\": %d", entry.m_scan.m_estimate.entropy,
+                    entry.m_scan.m_estimate.matchDensity, entry.m_scan.m_predicted_size);
+            }
+            fprintf(file, " }");
+        }
+        fprintf(file, "\n\t]\n}\n");
+        return fclose(file) == 0;
+    }
+
+private:
+    struct Totals {
+        void Add(double seconds, uint64_t bytes_in, uint64_t bytes_out)
+        {
+            m_count++;
+            m_seconds += seconds;
+            m_bytes_in += bytes_in;
+            m_bytes_out += bytes_out;
+        }
+
+        std::string m_name;
+        uint64_t m_count = 0;
+        double m_seconds = 0;
+        uint64_t m_bytes_in = 0;
+        uint64_t m_bytes_out = 0;
+    };
+
+    struct EntryTime {
+        std::string m_name;
+        int m_compression_type;
+        double m_seconds;
+        uint64_t m_raw_size;
+        uint64_t m_packed_size;
+        unsigned long long m_candidates;
+        unsigned long long m_bytes_compared;
+        PreScan m_scan;
+    };
+
+    //The counters read as zero when compression.c was built without them
+    bool HasCounters()
+    {
+        const unsigned long long *counters = (const unsigned long long *)&m_counters;
+        for (size_t i = 0; i < NUM_COUNTERS; i++) {
+            if (counters[i] != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //Ratio is always packed over raw size, and throughput is measured on the raw side
+    static double GetRatio(const Totals &codec, bool compress)
+    {
+        uint64_t raw = compress ? codec.m_bytes_in : codec.m_bytes_out;
+        uint64_t packed = compress ? codec.m_bytes_out : codec.m_bytes_in;
+        return raw ? (double)packed / raw : 0;
+    }
+
+    static double GetThroughput(const Totals &codec, bool compress)
+    {
+        uint64_t raw = compress ? codec.m_bytes_in : codec.m_bytes_out;
+        return codec.m_seconds > 0 ? raw / codec.m_seconds / 1000000.0 : 0;
+    }
+
+    std::mutex m_mutex;
+    std::vector<Totals> m_phases;
+    Totals m_compress[STATS_NUM_TYPES];
+    Totals m_decompress[STATS_NUM_TYPES];
+    COMPRESSIONCOUNTERS m_counters{};
+    std::vector<EntryTime> m_slowest;
+    Totals m_prescan; //bytes out counts the bytes sampled
+    uint64_t m_num_losses = 0;
+    uint64_t m_num_stored = 0;
+    double m_total_seconds = 0;
+};
+
+//Timeline of what every thread did, written by --trace in the Chrome trace event format that
+//chrome://tracing and Perfetto open. Safe to add to from any thread
+class Trace {
+public:
+    Trace() : m_start(GetTime())
+    {
+    }
+
+    //args holds the members of the span's JSON args object, e.g. "\"entry\": 3"
+    void AddSpan(std::string name, const char *category, double start, double end, std::string args)
+    {
+        int thread_id = GetThreadId();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_events.push_back({ name, category, start - m_start, end - start, thread_id, args });
+    }
+
+    bool Write(std::string path)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        FILE *file = fopen(path.c_str(), "w");
+        if (!file) {
+            return false;
+        }
+        fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+        for (size_t i = 0; i < m_events.size(); i++) {
+            const Event &event = m_events[i];
+            //Timestamps are in microseconds
+            fprintf(file, "%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, \"args\": {%s}}",
+                i == 0 ? "" : ",", EscapeJsonString(event.m_name).c_str(), event.m_category, event.m_start * 1000000.0,
+                event.m_duration * 1000000.0, event.m_thread_id, event.m_args.c_str());
+        }
+        fprintf(file, "\n]}\n");
+        return fclose(file) == 0;
+    }
+
+private:
+    struct Event {
+        std::string m_name;
+        const char *m_category;
+        double m_start;
+        double m_duration;
+        int m_thread_id;
+        std::string m_args;
+    };
+
+    //Threads are numbered in the order they first add a span
+    int GetThreadId()
+    {
+        static thread_local int t_thread_id = -1;
+        if (t_thread_id < 0) {
+            t_thread_id = m_next_thread_id++;
+        }
+        return t_thread_id;
+    }
+
+    double m_start;
+    std::mutex m_mutex;
+    std::vector<Event> m_events;
+    std::atomic<int> m_next_thread_id{0};
+};
+
+//Formats the args of a trace span about an entry; index -1 stands for the archive itself
+std::string GetTraceArgs(int entry_index, int compression_type, uint64_t bytes_in, uint64_t bytes_out)
+{
+    char args[160];
+    snprintf(args, sizeof(args), "\"entry\": %d, \"codec\": \"%s\", \"bytesIn\": %llu, \"bytesOut\": %llu", entry_index,
+        getCompressionTypeName(compression_type), (unsigned long long)bytes_in, (unsigned long long)bytes_out);
+    return args;
+}
+
+std::string GetTraceArgs(int entry_index, std::string path, uint64_t size)
+{
+    char args[64];
+    snprintf(args, sizeof(args), "\"entry\": %d, \"size\": %llu, ", entry_index, (unsigned long long)size);
+    return args + std::string("\"path\": \"") + EscapeJsonString(path) + "\"";
+}
+
+//What to do with an entry the pre-scan predicts a codec won't shrink
+enum IncompressibleAction {
+    INCOMPRESSIBLE_COMPRESS, //compress it anyway; the pre-scan then only runs for the stats
+    INCOMPRESSIBLE_WARN, //compress it anyway, but say so
+    INCOMPRESSIBLE_STORE //store it as is
+};
+
+struct ToolContext {
+    ThreadPool *m_pool = NULL;
+    CompressionCache *m_cache = NULL;
+    Stats *m_stats = NULL;
+    Trace *m_trace = NULL;
+    int m_default_level = COMPRESSION_LEVEL_DEFAULT;
+    IncompressibleAction m_incompressible = INCOMPRESSIBLE_COMPRESS;
+};
+
+//Records the phase that began at phase_start and starts the next one
+void EndPhase(ToolContext &context, const char *name, double &phase_start, uint64_t bytes_in, uint64_t bytes_out)
+{
+    double now = GetTime();
+    if (context.m_stats) {
+        context.m_stats->AddPhase(name, now - phase_start, bytes_in, bytes_out);
+    }
+    if (context.m_trace) {
+        char args[96];
+        snprintf(args, sizeof(args), "\"bytesIn\": %llu, \"bytesOut\": %llu", (unsigned long long)bytes_in, (unsigned long long)bytes_out);
+        context.m_trace->AddSpan(name, "phase", phase_start, now, args);
+    }
+    phase_start = now;
+}
+
+//Codec entry points that record every call when stats or a trace are being gathered. entry_index
+//is only used to tag the trace, with -1 for the archive itself. A bounded call that gives up is only traced,
+//but still adds to work
+char *CompressTimed(ToolContext *context, int entry_index, char *buffer, int size, int compression_type, int compression_level, int *compressed_size,
+    const COMPRESSIONBOUND *bound = NULL, CodecWork *work = NULL)
+{
+    CounterSpan counters;
+    double start = GetTime();
+    char *compressed = compressBounded(buffer, size, compression_type, compressed_size, compression_level, bound);
+    if (work) {
+        work->Add(GetTime() - start, counters.Get());
+    }
+    if (context && compressed) {
+        double end = GetTime();
+        if (context->m_stats) {
+            context->m_stats->AddCodecCall(true, compression_type, end - start, size, *compressed_size);
+            context->m_stats->AddCounters(counters.Get());
+        }
+        if (context->m_trace) {
+            context->m_trace->AddSpan("compress", "codec", start, end, GetTraceArgs(entry_index, compression_type, size, *compressed_size));
+        }
+    } else if (context && bound && context->m_trace) {
+        context->m_trace->AddSpan("compress (pruned)", "codec", start, GetTime(), GetTraceArgs(entry_index, compression_type, size, 0));
+    }
+    return compressed;
+}
+
+//State shared by the candidates of one COMPRESSION_AUTO entry. The best result so far is ranked by
+//size, then by the candidate's place in the order of preference, so the choice doesn't depend on
+//which candidate happens to finish first
+struct AutoSelection {
+    std::atomic<int64_t> m_best_key{INT64_MAX};
+    std::mutex m_mutex;
+    char *m_best = NULL;
+    int m_best_size = 0;
+    CodecWork m_work;
+};
+
+struct AutoCandidate {
+    AutoSelection *m_selection;
+    int m_rank;
+
+    int64_t GetKey(int size) const
+    {
+        return (int64_t)size * COMPRESSION_MAX_AUTO_CANDIDATES + m_rank;
+    }
+
+    static int GetMaxSize(void *param)
+    {
+        AutoCandidate *candidate = (AutoCandidate *)param;
+        int64_t max_size = (candidate->m_selection->m_best_key - candidate->m_rank - 1) / COMPRESSION_MAX_AUTO_CANDIDATES;
+        return max_size > INT_MAX ? INT_MAX : (int)max_size;
+    }
+};
+
+//COMPRESSION_AUTO on the pool: every candidate codec runs as its own job, and they all give up once
+//they grow past the best result another one has already finished with. work adds up all of them
+char *CompressAuto(ToolContext *context, int entry_index, char *buffer, int size, int compression_level, int *compressed_size,
+    CodecWork *work = NULL)
+{
+    if (!context || !context->m_pool) {
+        return CompressTimed(context, entry_index, buffer, size, COMPRESSION_AUTO, compression_level, compressed_size, NULL, work);
+    }
+    int candidates[COMPRESSION_MAX_AUTO_CANDIDATES];
+    int num_candidates = getAutoCandidates(size, candidates);
+    AutoSelection selection;
+    std::vector<AutoCandidate> ranks(num_candidates);
+    TaskGroup group;
+    auto run_candidate = [&](int rank) {
+        AutoCandidate &candidate = ranks[rank];
+        candidate.m_selection = &selection;
+        candidate.m_rank = rank;
+        COMPRESSIONBOUND bound = { AutoCandidate::GetMaxSize, &candidate };
+        int candidate_size = 0;
+        CodecWork candidate_work;
+        char *compressed = CompressTimed(context, entry_index, buffer, size, candidates[rank], compression_level, &candidate_size, &bound, &candidate_work);
+        std::lock_guard<std::mutex> lock(selection.m_mutex);
+        selection.m_work.Add(candidate_work.m_seconds, candidate_work.m_counters);
+        if (!compressed) {
+            return;
+        }
+        if (candidate.GetKey(candidate_size) < selection.m_best_key) {
+            free(selection.m_best);
+            selection.m_best = compressed;
+            selection.m_best_size = candidate_size;
+            selection.m_best_key = candidate.GetKey(candidate_size);
+        } else {
+            free(compressed);
+        }
+    };
+    //Storing the entry as is costs only a copy, and gives the others a size to beat from the start
+    run_candidate(0);
+    for (int i = 1; i < num_candidates; i++) {
+        context->m_pool->Submit(group, [&, i]() {
+            run_candidate(i);
+        });
+    }
+    context->m_pool->Wait(group);
+    if (work) {
+        work->Add(selection.m_work.m_seconds, selection.m_work.m_counters);
+    }
+    *compressed_size = selection.m_best_size;
+    return selection.m_best;
+}
+
+char *DecompressTimed(ToolContext *context, int entry_index, char *buffer, int size, int *uncompressed_size, int *compression_type)
+{
+    CounterSpan counters;
+    double start = GetTime();
+    char *raw = decompressDetect(buffer, size, uncompressed_size, compression_type);
+    if (context) {
+        double end = GetTime();
+        if (context->m_stats) {
+            if (raw) {
+                context->m_stats->AddCodecCall(false, *compression_type, end - start, size, *uncompressed_size);
+            }
+            context->m_stats->AddCounters(counters.Get());
+        }
+        if (context->m_trace) {
+            context->m_trace->AddSpan("decompress", "codec", start, end, GetTraceArgs(entry_index, *compression_type, size, *uncompressed_size));
+        }
+    }
+    return raw;
+}
+
+//Compresses a buffer, reusing an earlier result from the cache when one is given
+char *CompressCached(ToolContext &context, int entry_index, char *buffer, int size, int compression_type, int compression_level, int *compressed_size,
+    CodecWork *work = NULL)
+{
+    auto compress_now = [&]() {
+        if (compression_type == COMPRESSION_AUTO) {
+            return CompressAuto(&context, entry_index, buffer, size, compression_level, compressed_size, work);
+        }
+        return CompressTimed(&context, entry_index, buffer, size, compression_type, compression_level, compressed_size, NULL, work);
+    };
+    CompressionCache *cache = context.m_cache;
+    if (!cache || compression_type == COMPRESSION_NONE) {
+        return compress_now();
+    }
+    double start = GetTime();
+    std::string key = cache->GetKey(buffer, size, compression_type, compression_level);
+    char *compressed = cache->Load(key, *compressed_size);
+    if (!compressed) {
+        compressed = compress_now();
+        if (compressed) {
+            cache->Store(key, compressed, *compressed_size);
+        }
+    } else {
+        double end = GetTime();
+        if (work) {
+            work->Add(end - start, COMPRESSIONCOUNTERS{});
+        }
+        if (context.m_trace) {
+            context.m_trace->AddSpan("cache hit", "io", start, end, GetTraceArgs(entry_index, compression_type, size, *compressed_size));
+        }
+    }
+    return compressed;
+}
+
+//Samples data about to be compressed to predict whether compression_type will shrink it, and
+//returns the codec to actually use. Skipped unless it can change the outcome or stats are gathered
+int PreScanEntry(ToolContext &context, int entry_index, std::string name, char *buffer, int size, int compression_type, PreScan &scan)
 {
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        return NULL;
+    if (compression_type == COMPRESSION_NONE || (context.m_incompressible == INCOMPRESSIBLE_COMPRESS && !context.m_stats)) {
+        return compression_type;
     }
-    fseek(file, 0, SEEK_END);
-    size = ftell(file);
-    char *buffer = (char *)malloc(size);
-    fseek(file, 0, SEEK_SET);
-    int nbytes = fread(buffer, 1, size, file);
-    fclose(file);
-    if (size != nbytes) {
-        free(buffer);
-        return NULL;
+    double start = GetTime();
+    estimateCompression(buffer, size, &scan.m_estimate);
+    scan.m_done = true;
+    scan.m_predicted_size = estimateCompressedSize(&scan.m_estimate, size, compression_type);
+    scan.m_loss = scan.m_predicted_size >= size;
+    scan.m_stored = scan.m_loss && context.m_incompressible == INCOMPRESSIBLE_STORE;
+    double end = GetTime();
+    if (context.m_stats) {
+        context.m_stats->AddPreScan(end - start, size, scan);
     }
-    return buffer;
+    if (context.m_trace) {
+        char args[96];
+        snprintf(args, sizeof(args), ", \"entropy\": %.4f, \"matchDensity\": %.4f", scan.m_estimate.entropy, scan.m_estimate.matchDensity);
+        context.m_trace->AddSpan("pre-scan", "codec", start, end, GetTraceArgs(entry_index, compression_type, size, scan.m_predicted_size) + args);
+    }
+    if (scan.m_loss && context.m_incompressible == INCOMPRESSIBLE_WARN) {
+        std::cout << "Warning: " << getCompressionTypeName(compression_type) << " is not expected to shrink " << name << "." << std::endl;
+    }
+    return scan.m_stored ? COMPRESSION_NONE : compression_type;
 }
 
 struct InputFile {
@@ -50,6 +1116,7 @@ struct InputFile {
     InputFile(const InputFile &other) {
         m_path = other.m_path;
         m_compression_type = other.m_compression_type;
+        m_compression_level = other.m_compression_level;
         m_compresssed_size = other.m_compresssed_size;
         m_compressed_buffer = (char *)malloc(m_compresssed_size);
         memcpy(m_compressed_buffer, other.m_compressed_buffer, m_compresssed_size);
@@ -68,25 +1135,46 @@ struct InputFile {
         m_compresssed_size = 0;
     }
 
-    bool SetFileInfo(std::string path, int compression_type)
+    bool SetFileInfo(std::string path, int compression_type, int compression_level, int index, ToolContext &context)
     {
-        if (m_path != path || m_compression_type != compression_type) {
+        if (m_path != path || m_compression_type != compression_type || m_compression_level != compression_level) {
             CleanupBuffer();
-            int raw_size;
-            char *raw_buffer = ReadDataFile(path.c_str(), raw_size);
-            if (raw_buffer == NULL) {
+            double start = GetTime();
+            MappedFile raw_file;
+            if (!raw_file.Open(path.c_str())) {
+                std::cout << "Failed to open " << path << "." << std::endl;
+                return false;
+            }
+            if (context.m_trace) {
+                context.m_trace->AddSpan("read", "io", start, GetTime(), GetTraceArgs(index, path, raw_file.GetSize()));
+            }
+            PreScan scan;
+            int used_type = PreScanEntry(context, index, path, raw_file.GetData(), raw_file.GetSize(), compression_type, scan);
+            //An AUTO entry's candidates may run on other threads, or wait for one, so only the time
+            //and counters of its own codec calls are charged to it
+            double compress_start = GetTime();
+            CodecWork work;
+            m_compressed_buffer = CompressCached(context, index, raw_file.GetData(), raw_file.GetSize(), used_type, compression_level, &m_compresssed_size, &work);
+            if (!m_compressed_buffer) {
+                //Out of memory, or the codec failed; the input is unmapped as raw_file goes out of scope
+                std::cout << "Failed to compress " << path << "." << std::endl;
+                CleanupBuffer();
+                m_path.clear();
                 return false;
             }
-            m_compressed_buffer = compress(raw_buffer, raw_size, compression_type, &m_compresssed_size);
-            free(raw_buffer);
+            if (context.m_stats) {
+                context.m_stats->AddEntry(path, used_type, compress_start - start + work.m_seconds, raw_file.GetSize(), m_compresssed_size, work.m_counters, &scan);
+            }
         }
         m_path = path;
         m_compression_type = compression_type;
+        m_compression_level = compression_level;
         return true;
     }
 
     std::string m_path;
     int m_compression_type = COMPRESSION_NONE;
+    int m_compression_level = COMPRESSION_LEVEL_DEFAULT;
     char *m_compressed_buffer = NULL;
     int m_compresssed_size = 0;
 };
@@ -100,13 +1188,13 @@ void WriteMemoryBufU32(uint8_t *buf, uint32_t value)
     buf[0] = value & 0xFF;
 }
 
-void WriteFileU32(FILE *file, uint32_t value)
+void WriteBufferU32(std::vector<uint8_t> &buf, uint32_t value)
 {
     //Convert uint32_t to 4 bytes
     uint8_t temp[4];
     WriteMemoryBufU32(temp, value);
-    //Write it to file
-    fwrite(temp, 4, 1, file);
+    //Append them to the buffer
+    buf.insert(buf.end(), temp, temp + 4);
 }
 
 void RoundUpU32(uint32_t &value, uint32_t to)
@@ -114,6 +1202,14 @@ void RoundUpU32(uint32_t &value, uint32_t to)
     value = ((value + to - 1) / to) * to;
 }
 
+void PadBuffer(std::vector<uint8_t> &buf, uint32_t to, uint8_t value)
+{
+    //Append padding value until buffer is aligned to a multiple of to bytes
+    while (buf.size() % to > 0) {
+        buf.push_back(value);
+    }
+}
+
 void PadFile(FILE *file, uint32_t to, uint8_t value)
 {
     uint32_t ofs = ftell(file);
@@ -125,91 +1221,400 @@ void PadFile(FILE *file, uint32_t to, uint8_t value)
 }
 
 
-bool RebuildArchive(std::string in_name, std::string out_name)
+//Accepts only a plain number from COMPRESSION_LEVEL_FAST to COMPRESSION_LEVEL_OPTIMAL
+bool ParseCompressionLevel(std::string str, int &level)
+{
+    if (str.empty() || str.size() > 2 || str.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    int value = atoi(str.c_str());
+    if (value < COMPRESSION_LEVEL_FAST || value > COMPRESSION_LEVEL_OPTIMAL) {
+        return false;
+    }
+    level = value;
+    return true;
+}
+
+bool ParseCompressionSpec(std::string spec, int &type, int &level)
+{
+    //A compression name may carry a level suffix, e.g. COMPRESSION_LZ11:3
+    if (!spec.empty() && spec.back() == '\r') {
+        spec.pop_back();
+    }
+    size_t colon_pos = spec.find_first_of(":");
+    if (colon_pos != std::string::npos) {
+        if (!ParseCompressionLevel(spec.substr(colon_pos + 1), level)) {
+            return false;
+        }
+        spec = spec.substr(0, colon_pos);
+    }
+    type = getCompressionTypeId(spec.c_str());
+    return true;
+}
+
+//Compresses the archive straight into out_name as its header and entries are appended, so neither the
+//whole archive nor its compressed copy is ever held in memory. Entry buffers are freed once written
+bool WriteArchiveStreamed(std::string out_name, std::vector<uint8_t> &header, std::vector<InputFile> &input_files, uint32_t archive_size,
+    int compression_type, int compression_level, uint64_t &out_size, ToolContext &context)
+{
+    COMPRESSIONSTREAM *stream = compressStreamCreate(compression_type, archive_size, compression_level);
+    if (!stream) {
+        std::cout << "Failed to compress " << out_name << "." << std::endl;
+        return false;
+    }
+    FILE *out_file = fopen(out_name.c_str(), "wb");
+    if (!out_file) {
+        std::cout << "Failed to open " << out_name << " for writing." << std::endl;
+        compressStreamFree(stream);
+        return false;
+    }
+    CounterSpan counters;
+    double start = GetTime();
+    std::vector<char> chunk(0x10000);
+    bool write_ok = true;
+    out_size = 0;
+    //Feed a piece of the archive, writing out whatever compressed data it lets through
+    auto append = [&](const char *data, int size) {
+        do {
+            int taken = compressStreamFeed(stream, data, size);
+            data += taken;
+            size -= taken;
+            int drained;
+            while ((drained = compressStreamDrain(stream, chunk.data(), chunk.size())) > 0) {
+                write_ok = fwrite(chunk.data(), 1, drained, out_file) == (size_t)drained && write_ok;
+                out_size += drained;
+            }
+        } while (size > 0);
+    };
+    static const char padding[4] = { 0 };
+    append((const char *)header.data(), header.size());
+    for (uint32_t i = 0; i < input_files.size(); i++) {
+        append(input_files[i].m_compressed_buffer, input_files[i].m_compresssed_size);
+        append(padding, (4 - (input_files[i].m_compresssed_size & 3)) & 3);
+        input_files[i].CleanupBuffer();
+    }
+    bool result = compressStreamFinish(stream);
+    compressStreamFree(stream);
+    PadFile(out_file, 4, 0);
+    result = fclose(out_file) == 0 && write_ok && result;
+    if (!result) {
+        std::cout << "Failed to write " << out_name << "." << std::endl;
+        return false;
+    }
+    double end = GetTime();
+    if (context.m_stats) {
+        context.m_stats->AddCodecCall(true, compression_type, end - start, archive_size, out_size);
+        context.m_stats->AddCounters(counters.Get());
+    }
+    if (context.m_trace) {
+        context.m_trace->AddSpan("compress", "codec", start, end, GetTraceArgs(-1, compression_type, archive_size, out_size));
+    }
+    return true;
+}
+
+bool RebuildArchive(std::string in_name, std::string out_name, ToolContext &context)
 {
+    double phase_start = GetTime();
+    int default_level = context.m_default_level;
     int archive_compress_type = COMPRESSION_NONE;
-    std::vector<InputFile> input_files;
+    int archive_compress_level = default_level;
+    std::vector<std::string> paths;
+    std::vector<int> compression_types;
+    std::vector<int> compression_levels;
     std::ifstream in_file(in_name);
     if (!in_file.is_open()) {
         std::cout << "Failed to open " << in_name << " for reading." << std::endl;
         return false;
     }
     std::string line;
+    int line_num = 1;
     std::getline(in_file, line);
-    archive_compress_type = getCompressionTypeId(line.c_str());
+    if (!ParseCompressionSpec(line, archive_compress_type, archive_compress_level)) {
+        std::cout << "Invalid compression level on line " << line_num << " of " << in_name << ": " << line << std::endl;
+        return false;
+    }
     std::string list_base_path = in_name.substr(0, in_name.find_last_of("\\/") + 1);
     while (std::getline(in_file, line)) {
+        line_num++;
         if (line.find("COMPRESSION") == 0) {
             //Separate out compression format
             size_t comma_pos = line.find_first_of(",");
             if (comma_pos == -1) {
                 continue;
             }
-            int compression_type = getCompressionTypeId(line.substr(0, comma_pos).c_str());
-            //Read input file
-            std::string path = list_base_path+line.substr(comma_pos + 1);
-            InputFile input_file;
-            if (!input_file.SetFileInfo(path, compression_type)) {
-                std::cout << "Failed to open " << path << "." << std::endl;
+            int compression_type;
+            int compression_level = default_level;
+            if (!ParseCompressionSpec(line.substr(0, comma_pos), compression_type, compression_level)) {
+                std::cout << "Invalid compression level on line " << line_num << " of " << in_name << ": " << line << std::endl;
                 return false;
             }
-            input_files.push_back(input_file);
+            paths.push_back(list_base_path+line.substr(comma_pos + 1));
+            compression_types.push_back(compression_type);
+            compression_levels.push_back(compression_level);
         }
     }
     in_file.close();
-    FILE *out_file = fopen(out_name.c_str(), "wb");
-    if (!out_file) {
-        std::cout << "Failed to open " << out_file << " for writing." << std::endl;
-        return false;
+    EndPhase(context, "rebuild: read list", phase_start, 0, 0);
+    //Read and compress input files in parallel, biggest first so a huge file doesn't finish last
+    std::vector<InputFile> input_files(paths.size());
+    std::vector<long> file_sizes(paths.size());
+    std::vector<size_t> order(paths.size());
+    std::vector<char> file_ok(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+        file_sizes[i] = GetFileSize(paths[i].c_str());
+        order[i] = i;
     }
-    //Write archive header
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return file_sizes[a] > file_sizes[b];
+    });
+    TaskGroup group;
+    for (size_t i = 0; i < order.size(); i++) {
+        size_t index = order[i];
+        context.m_pool->Submit(group, [&, index]() {
+            file_ok[index] = input_files[index].SetFileInfo(paths[index], compression_types[index], compression_levels[index], index, context);
+        });
+    }
+    context.m_pool->Wait(group);
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (!file_ok[i]) {
+            //SetFileInfo has already said why
+            return false;
+        }
+    }
+    //Assemble the archive in memory
+    std::vector<uint8_t> archive;
     uint32_t file_ofs = input_files.size() * 8;
-    WriteFileU32(out_file, input_files.size());
+    uint32_t archive_size = file_ofs + 4;
+    uint64_t raw_size = 0;
+    uint64_t entries_size = 0;
+    for (uint32_t i = 0; i < input_files.size(); i++) {
+        raw_size += file_sizes[i];
+        entries_size += input_files[i].m_compresssed_size;
+        archive_size += input_files[i].m_compresssed_size;
+        RoundUpU32(archive_size, 4);
+    }
+    EndPhase(context, "rebuild: read and compress entries", phase_start, raw_size, entries_size);
+    //The LZ codecs can compress the archive as it is written, unless the cache or the pre-scan needs to see all of it
+    bool stream_archive = (archive_compress_type == COMPRESSION_LZ77 || archive_compress_type == COMPRESSION_LZ11 ||
+        archive_compress_type == COMPRESSION_LZ77_HEADER) && !context.m_cache && context.m_incompressible == INCOMPRESSIBLE_COMPRESS;
+    if (!stream_archive) {
+        archive.reserve(archive_size);
+    }
+    //Write archive header
+    WriteBufferU32(archive, input_files.size());
     for (uint32_t i = 0; i < input_files.size(); i++) {
-        WriteFileU32(out_file, file_ofs);
-        WriteFileU32(out_file, input_files[i].m_compresssed_size);
+        WriteBufferU32(archive, file_ofs);
+        WriteBufferU32(archive, input_files[i].m_compresssed_size);
         file_ofs += input_files[i].m_compresssed_size;
         RoundUpU32(file_ofs, 4);
     }
+    EndPhase(context, "rebuild: write header", phase_start, 0, archive.size());
+    if (stream_archive) {
+        uint64_t archive_size_compressed = 0;
+        bool result = WriteArchiveStreamed(out_name, archive, input_files, archive_size, archive_compress_type, archive_compress_level,
+            archive_size_compressed, context);
+        //The same phase as below, so totals compare whichever way the archive was written; here it includes the writes
+        if (result) {
+            EndPhase(context, "rebuild: compress archive", phase_start, archive_size, archive_size_compressed);
+        }
+        return result;
+    }
     //Write file data
     for (uint32_t i = 0; i < input_files.size(); i++) {
-        fwrite(input_files[i].m_compressed_buffer, 1, input_files[i].m_compresssed_size, out_file);
-        PadFile(out_file, 4, 0);
+        archive.insert(archive.end(), input_files[i].m_compressed_buffer, input_files[i].m_compressed_buffer + input_files[i].m_compresssed_size);
+        input_files[i].CleanupBuffer();
+        PadBuffer(archive, 4, 0);
     }
-    fclose(out_file);
-    //Compress the archive
-    {
-        int archive_size = 0;
-        char *archive_raw = ReadDataFile(out_name.c_str(), archive_size);
-        int archive_size_compressed;
-        char *archive_compressed = compress(archive_raw, archive_size, archive_compress_type, &archive_size_compressed);
-        free(archive_raw);
-        out_file = fopen(out_name.c_str(), "wb");
+    EndPhase(context, "rebuild: copy entries", phase_start, entries_size, archive.size());
+    //Compress the archive and write it out once
+    char *archive_compressed = (char *)archive.data();
+    int archive_size_compressed = archive.size();
+    //Only sampled when that may change the codec: a streamed archive is never held whole, so it can't
+    //be, and --stats must not count one more pre-scanned entry just because this archive wasn't streamed
+    if (context.m_incompressible != INCOMPRESSIBLE_COMPRESS) {
+        PreScan archive_scan;
+        archive_compress_type = PreScanEntry(context, -1, out_name, (char *)archive.data(), archive.size(), archive_compress_type, archive_scan);
+    }
+    if (archive_compress_type != COMPRESSION_NONE) {
+        archive_compressed = CompressCached(context, -1, (char *)archive.data(), archive.size(), archive_compress_type, archive_compress_level, &archive_size_compressed);
+        if (!archive_compressed) {
+            std::cout << "Failed to compress " << out_name << "." << std::endl;
+            return false;
+        }
+        EndPhase(context, "rebuild: compress archive", phase_start, archive.size(), archive_size_compressed);
+    }
+    FILE *out_file = fopen(out_name.c_str(), "wb");
+    if (out_file) {
         fwrite(archive_compressed, 1, archive_size_compressed, out_file);
         PadFile(out_file, 4, 0);
-        free(archive_compressed);
         fclose(out_file);
+        EndPhase(context, "rebuild: write archive", phase_start, archive_size_compressed, archive_size_compressed);
+    } else {
+        std::cout << "Failed to open " << out_name << " for writing." << std::endl;
     }
-    
-    return true;
+    if (archive_compress_type != COMPRESSION_NONE) {
+        free(archive_compressed);
+    }
+    return out_file != NULL;
 }
 
-bool ExtractArchive(std::string in_name, std::string out_name)
-{
-    int archive_size;
-    char *archive_buf;
-    int archive_comp_type;
+//An archive opened for reading. The container is decompressed once on Open, after which
+//entries can be looked up by index without touching the rest of the archive
+class Archive {
+public:
+    Archive() = default;
+    Archive(const Archive &) = delete;
+    Archive &operator=(const Archive &) = delete;
+
+    ~Archive()
     {
-        int in_size;
-        char *in_buf = ReadDataFile(in_name.c_str(), in_size);
-        if (!in_buf) {
-            std::cout << "Failed to read " << in_name << "." << std::endl;
+        Close();
+    }
+
+    bool Open(const char *path, ToolContext *context = NULL)
+    {
+        Close();
+        if (!m_file.Open(path)) {
+            return false;
+        }
+        int size;
+        m_packed_size = m_file.GetSize();
+        m_data = DecompressTimed(context, -1, m_file.GetData(), m_file.GetSize(), &size, &m_compression_type);
+        if (m_compression_type == COMPRESSION_NONE) {
+            //Use the input as is rather than copying it
+            m_data = m_file.GetData();
+            size = m_file.GetSize();
+        } else if (!m_data) {
+            //Compressed, but there was no memory to decompress it into
+            Close();
+            return false;
+        } else {
+            m_file.Close();
+        }
+        m_size = size;
+        if (!m_data || m_size < 4 || GetNumEntries() > (m_size - 4) / 8) {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+        if (m_compression_type != COMPRESSION_NONE) {
+            free(m_data);
+        }
+        m_file.Close();
+        m_data = NULL;
+        m_size = 0;
+        m_packed_size = 0;
+        m_compression_type = COMPRESSION_NONE;
+    }
+
+    int GetCompressionType()
+    {
+        return m_compression_type;
+    }
+
+    //Sizes of the archive as stored and once decompressed
+    uint32_t GetPackedSize()
+    {
+        return m_packed_size;
+    }
+
+    uint32_t GetSize()
+    {
+        return m_size;
+    }
+
+    uint32_t GetNumEntries()
+    {
+        return *(uint32_t *)m_data;
+    }
+
+    //Finds the bytes of an entry. Entries span up to the start of the next one, so the padding
+    //after each entry is included, as it always has been when extracting
+    bool GetEntry(uint32_t index, char *&data, uint32_t &size)
+    {
+        uint32_t num_files = GetNumEntries();
+        if (index >= num_files) {
+            return false;
+        }
+        uint32_t *table = (uint32_t *)m_data;
+        uint64_t start = (uint64_t)table[(index * 2) + 1] + 4;
+        uint64_t end;
+        if (index == num_files - 1) {
+            end = m_size;
+        } else {
+            end = (uint64_t)table[(index * 2) + 3] + 4;
+        }
+        if (start > end || end > m_size) {
             return false;
         }
-        archive_comp_type = getCompressionType(in_buf, in_size);
-        archive_buf = decompress(in_buf, in_size, &archive_size);
-        free(in_buf);
+        data = m_data + start;
+        size = end - start;
+        return true;
+    }
+
+private:
+    MappedFile m_file;
+    char *m_data = NULL;
+    uint32_t m_size = 0;
+    uint32_t m_packed_size = 0;
+    int m_compression_type = COMPRESSION_NONE;
+};
+
+//Decodes a single entry of an archive and writes it to path, returning its type and decoded size
+bool ExtractEntry(Archive &archive, uint32_t index, std::string path, int &compression_type, uint32_t &decoded_size, ToolContext &context)
+{
+    char *entry_buf;
+    uint32_t entry_size;
+    double start = GetTime();
+    CounterSpan counters;
+    compression_type = COMPRESSION_NONE;
+    decoded_size = 0;
+    if (!archive.GetEntry(index, entry_buf, entry_size)) {
+        return false;
+    }
+    int raw_size;
+    char *raw_buf = DecompressTimed(&context, index, entry_buf, entry_size, &raw_size, &compression_type);
+    if (compression_type == COMPRESSION_NONE) {
+        //Uncompressed entries are written straight from the archive
+        raw_buf = entry_buf;
+    } else if (!raw_buf) {
+        //Compressed, but there was no memory to decompress it into
+        std::cout << "Failed to decompress entry " << index << "." << std::endl;
+        return false;
+    }
+    double write_start = GetTime();
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file) {
+        fwrite(raw_buf, 1, raw_size, file);
+        fclose(file);
+    }
+    if (compression_type != COMPRESSION_NONE) {
+        free(raw_buf);
+    }
+    decoded_size = raw_size;
+    double end = GetTime();
+    if (context.m_trace) {
+        context.m_trace->AddSpan("write", "io", write_start, end, GetTraceArgs(index, path, raw_size));
+    }
+    if (context.m_stats) {
+        context.m_stats->AddEntry(path, compression_type, end - start, raw_size, entry_size, counters.Get());
+    }
+    return file != NULL;
+}
+
+bool ExtractArchive(std::string in_name, std::string out_name, ToolContext &context)
+{
+    double phase_start = GetTime();
+    Archive archive;
+    if (!archive.Open(in_name.c_str(), &context)) {
+        std::cout << "Failed to read " << in_name << "." << std::endl;
+        return false;
     }
+    EndPhase(context, "extract: read and decompress archive", phase_start, archive.GetPackedSize(), archive.GetSize());
     std::ofstream out_file(out_name);
     if (!out_file.is_open()) {
         std::cout << "Failed to open " << out_name << " for writing." << std::endl;
@@ -225,69 +1630,397 @@ bool ExtractArchive(std::string in_name, std::string out_name)
         out_file.close();
         return false;
     }
-    out_file << getCompressionTypeName(archive_comp_type) << std::endl << std::endl;
-    uint32_t *archive_data = (uint32_t *)archive_buf;
-    uint32_t num_files = *archive_data;
+    out_file << getCompressionTypeName(archive.GetCompressionType()) << std::endl << std::endl;
+    uint32_t num_files = archive.GetNumEntries();
+    //Every entry's range is known from the header, so decompress and write them in parallel,
+    //biggest first, and only list them afterwards to keep the original order
+    std::vector<uint32_t> sizes(num_files);
+    std::vector<uint32_t> decoded_sizes(num_files);
+    std::vector<int> compression_types(num_files);
+    std::vector<char> file_ok(num_files);
+    std::vector<uint32_t> order(num_files);
     for (uint32_t i = 0; i < num_files; i++) {
-        uint32_t start = archive_data[(i * 2) + 1] + 4;
-        uint32_t end;
-        if (i == num_files - 1) {
-            end = archive_size;
-        } else {
-            end = archive_data[(i * 2) + 3] + 4;
+        char *entry_buf;
+        if (!archive.GetEntry(i, entry_buf, sizes[i])) {
+            std::cout << "Entry " << i << " of " << in_name << " is out of bounds." << std::endl;
+            out_file.close();
+            return false;
         }
-        uint32_t size = end - start;
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return sizes[a] > sizes[b];
+    });
+    TaskGroup group;
+    for (uint32_t i = 0; i < num_files; i++) {
+        uint32_t index = order[i];
+        context.m_pool->Submit(group, [&, index]() {
+            std::string path = dest_dir + std::to_string(index) + ".bin";
+            file_ok[index] = ExtractEntry(archive, index, path, compression_types[index], decoded_sizes[index], context);
+        });
+    }
+    context.m_pool->Wait(group);
+    uint64_t entries_size = 0;
+    uint64_t raw_size = 0;
+    for (uint32_t i = 0; i < num_files; i++) {
+        entries_size += sizes[i];
+        raw_size += decoded_sizes[i];
+    }
+    EndPhase(context, "extract: decompress and write entries", phase_start, entries_size, raw_size);
+    for (uint32_t i = 0; i < num_files; i++) {
         std::string filename = std::to_string(i) + ".bin";
-        std::string path = dest_dir + filename;
-        int compression_type = getCompressionType(&archive_buf[start], size);
-        out_file << getCompressionTypeName(compression_type) << "," << subdir_name+filename << std::endl;
-        int raw_size;
-        char *raw_buf = decompress(&archive_buf[start], size, &raw_size);
-        FILE *file = fopen(path.c_str(), "wb");
-        if (!file) {
-            std::cout << "Failed to open " << path << " for writing." << std::endl;
+        if (!file_ok[i]) {
+            std::cout << "Failed to open " << dest_dir + filename << " for writing." << std::endl;
             out_file.close();
-            free(archive_buf);
             return false;
         }
-
-        fwrite(raw_buf, 1, raw_size, file);
-        fclose(file);
-        free(raw_buf);
+        out_file << getCompressionTypeName(compression_types[i]) << "," << subdir_name+filename << std::endl;
     }
     out_file.close();
-    free(archive_buf);
+    EndPhase(context, "extract: write list", phase_start, 0, 0);
     return true;
 }
 
-int main(int argc, char **argv)
+//Extracts only the listed entries of an archive, each to its own file
+bool ExtractEntries(std::string in_name, const std::vector<uint32_t> &indices, const std::vector<std::string> &out_names, ToolContext &context)
 {
-    if (argc != 2 && argc != 3) {
-        std::cout << "Invalid number of arguments" << std::endl;
-        std::cout << "Usage: " << argv[0] << " in [out]" << std::endl;
-        std::cout << "The out parameter is optional" << std::endl;
-        return 1;
+    double phase_start = GetTime();
+    Archive archive;
+    if (!archive.Open(in_name.c_str(), &context)) {
+        std::cout << "Failed to read " << in_name << "." << std::endl;
+        return false;
+    }
+    EndPhase(context, "extract: read and decompress archive", phase_start, archive.GetPackedSize(), archive.GetSize());
+    uint32_t num_files = archive.GetNumEntries();
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (indices[i] >= num_files) {
+            std::cout << "Entry " << indices[i] << " is out of range; " << in_name << " has " << num_files << " entries." << std::endl;
+            return false;
+        }
+    }
+    std::vector<int> compression_types(indices.size());
+    std::vector<uint32_t> decoded_sizes(indices.size());
+    std::vector<char> file_ok(indices.size());
+    TaskGroup group;
+    for (size_t i = 0; i < indices.size(); i++) {
+        context.m_pool->Submit(group, [&, i]() {
+            file_ok[i] = ExtractEntry(archive, indices[i], out_names[i], compression_types[i], decoded_sizes[i], context);
+        });
     }
-    bool rebuild;
-    std::string in_name = argv[1];
-    std::string out_name;
-    if (argc == 3) {
-        out_name = argv[2];
+    context.m_pool->Wait(group);
+    uint64_t entries_size = 0;
+    uint64_t raw_size = 0;
+    for (size_t i = 0; i < indices.size(); i++) {
+        char *entry_buf;
+        uint32_t entry_size;
+        if (archive.GetEntry(indices[i], entry_buf, entry_size)) {
+            entries_size += entry_size;
+        }
+        raw_size += decoded_sizes[i];
     }
-    if (in_name.rfind(".bin") != std::string::npos) {
-        rebuild = false;
-        if (argc != 3) {
-            out_name = in_name.substr(0, in_name.find_last_of(".")) + ".lst";
+    EndPhase(context, "extract: decompress and write entries", phase_start, entries_size, raw_size);
+    bool result = true;
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (!file_ok[i]) {
+            std::cout << "Failed to extract entry " << indices[i] << " to " << out_names[i] << "." << std::endl;
+            result = false;
         }
+    }
+    return result;
+}
+
+//Archives are extracted to a list and lists are rebuilt into archives
+bool IsArchiveName(std::string name)
+{
+    return name.rfind(".bin") != std::string::npos;
+}
+
+std::string GetDefaultOutputName(std::string in_name)
+{
+    std::string base = in_name.substr(0, in_name.find_last_of("."));
+    return base + (IsArchiveName(in_name) ? ".lst" : ".bin");
+}
+
+bool ProcessInput(std::string in_name, std::string out_name, ToolContext &context)
+{
+    if (IsArchiveName(in_name)) {
+        return ExtractArchive(in_name, out_name, context);
     } else {
-        rebuild = true;
-        if (argc != 3) {
-            out_name = in_name.substr(0, in_name.find_last_of(".")) + ".bin";
+        return RebuildArchive(in_name, out_name, context);
+    }
+}
+
+//Reads one input path per line; blank lines are skipped
+bool ReadResponseFile(std::string path, std::vector<std::string> &names)
+{
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) {
+            line.pop_back();
         }
+        if (!line.empty()) {
+            names.push_back(line);
+        }
+    }
+    return true;
+}
+
+//Identifies the file at path, so different spellings of one existing file compare equal
+std::string GetFileKey(std::string path)
+{
+#if !defined(_WIN32)
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0) {
+        return "file:" + std::to_string(info.st_dev) + ":" + std::to_string(info.st_ino);
+    }
+#endif
+    return "path:" + path;
+}
+
+//The inputs of a batch run in parallel, so none may write over another one or share its output
+bool CheckBatchOutputs(const std::vector<std::string> &in_names)
+{
+    std::map<std::string, size_t> inputs;
+    for (size_t i = 0; i < in_names.size(); i++) {
+        inputs.insert(std::make_pair(GetFileKey(in_names[i]), i));
+    }
+    std::map<std::string, size_t> outputs;
+    for (size_t i = 0; i < in_names.size(); i++) {
+        std::string out_name = GetDefaultOutputName(in_names[i]);
+        std::string key = GetFileKey(out_name);
+        auto input = inputs.find(key);
+        if (input != inputs.end()) {
+            std::cout << "Output " << out_name << " of " << in_names[i] << " is also the input " << in_names[input->second] << "." << std::endl;
+            return false;
+        }
+        auto output = outputs.insert(std::make_pair(key, i));
+        if (!output.second) {
+            std::cout << "Inputs " << in_names[output.first->second] << " and " << in_names[i] << " both write to " << out_name << "." << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//Processes every input on the shared pool. Each input is a job of its own whose entries are
+//jobs as well, so one huge archive and many small ones keep every thread busy together
+bool ProcessBatch(const std::vector<std::string> &in_names, ToolContext &context)
+{
+    if (!CheckBatchOutputs(in_names)) {
+        return false;
+    }
+    std::vector<long> sizes(in_names.size());
+    std::vector<size_t> order(in_names.size());
+    for (size_t i = 0; i < in_names.size(); i++) {
+        sizes[i] = GetFileSize(in_names[i].c_str());
+        order[i] = i;
+    }
+    //Start the biggest inputs first so they don't finish last
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return sizes[a] > sizes[b];
+    });
+    std::vector<char> input_ok(in_names.size());
+    TaskGroup group;
+    for (size_t i = 0; i < in_names.size(); i++) {
+        size_t index = order[i];
+        context.m_pool->Submit(group, [&, index]() {
+            input_ok[index] = ProcessInput(in_names[index], GetDefaultOutputName(in_names[index]), context);
+        });
+    }
+    context.m_pool->Wait(group);
+    size_t num_failed = 0;
+    for (size_t i = 0; i < in_names.size(); i++) {
+        if (!input_ok[i]) {
+            num_failed++;
+        }
+    }
+    if (num_failed != 0) {
+        std::cout << num_failed << " of " << in_names.size() << " inputs failed." << std::endl;
+    }
+    return num_failed == 0;
+}
+
+//Prints and writes out the gathered stats and trace as asked for on the command line
+bool WriteReports(ToolContext &context, double total_seconds, bool print_stats, std::string stats_json_name, std::string trace_name)
+{
+    bool result = true;
+    if (context.m_stats) {
+        context.m_stats->SetTotalTime(total_seconds);
+        if (print_stats) {
+            std::cout << std::endl;
+            context.m_stats->Print();
+        }
+        if (!stats_json_name.empty() && !context.m_stats->WriteJson(stats_json_name)) {
+            std::cout << "Failed to write " << stats_json_name << "." << std::endl;
+            result = false;
+        }
+    }
+    if (context.m_trace && !context.m_trace->Write(trace_name)) {
+        std::cout << "Failed to write " << trace_name << "." << std::endl;
+        result = false;
+    }
+    return result;
+}
+
+void PrintUsage(const char *program)
+{
+    std::cout << "Usage: " << program << " [options] in [out]" << std::endl;
+    std::cout << "       " << program << " [options] extract archive.bin index out [index out]..." << std::endl;
+    std::cout << "       " << program << " [options] batch in... [@response_file]..." << std::endl;
+    std::cout << "The out parameter is optional" << std::endl;
+    std::cout << "The extract form decodes only the given entries of an archive" << std::endl;
+    std::cout << "The batch form processes many inputs at once, writing each to its default output;" << std::endl;
+    std::cout << "a response file lists one input per line" << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -l N    Default compression level for rebuilding (0 = fastest, 3 = smallest, default 1)" << std::endl;
+    std::cout << "  -j N    Number of threads to use (default: one per core)" << std::endl;
+    std::cout << "  --cache DIR         Reuse compressed entries from DIR when rebuilding" << std::endl;
+    std::cout << "  --cache-limit MB    Size limit of the cache directory (default 1024)" << std::endl;
+    std::cout << "  --stats             Print per-phase, per-codec and slowest entry timings and codec counters when done" << std::endl;
+    std::cout << "  --stats-json FILE   Write the same timings to FILE as JSON" << std::endl;
+    std::cout << "  --trace FILE        Write a timeline of reads, writes, codec calls and phases to FILE" << std::endl;
+    std::cout << "                      as Chrome trace events, viewable in chrome://tracing or Perfetto" << std::endl;
+    std::cout << "  --incompressible warn|store" << std::endl;
+    std::cout << "                      Sample each entry before compressing it, and warn about or store as is" << std::endl;
+    std::cout << "                      the ones its codec is predicted not to shrink" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    int level = COMPRESSION_LEVEL_DEFAULT;
+    int num_threads = std::thread::hardware_concurrency();
+    std::string cache_dir;
+    uint64_t cache_limit = 1024;
+    bool print_stats = false;
+    std::string stats_json_name;
+    std::string trace_name;
+    IncompressibleAction incompressible = INCOMPRESSIBLE_COMPRESS;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-l" && i + 1 < argc) {
+            if (!ParseCompressionLevel(argv[++i], level)) {
+                std::cout << "Invalid compression level " << argv[i] << "." << std::endl;
+                return 1;
+            }
+        } else if (arg == "-j" && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+            if (num_threads < 1) {
+                std::cout << "Invalid thread count " << argv[i] << "." << std::endl;
+                return 1;
+            }
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (arg == "--cache-limit" && i + 1 < argc) {
+            cache_limit = strtoull(argv[++i], NULL, 10);
+        } else if (arg == "--stats") {
+            print_stats = true;
+        } else if (arg == "--stats-json" && i + 1 < argc) {
+            stats_json_name = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_name = argv[++i];
+        } else if (arg == "--incompressible" && i + 1 < argc) {
+            std::string action = argv[++i];
+            if (action == "warn") {
+                incompressible = INCOMPRESSIBLE_WARN;
+            } else if (action == "store") {
+                incompressible = INCOMPRESSIBLE_STORE;
+            } else {
+                std::cout << "Invalid incompressible action " << action << "." << std::endl;
+                return 1;
+            }
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            std::cout << "Unknown option " << arg << std::endl;
+            PrintUsage(argv[0]);
+            return 1;
+        } else {
+            args.push_back(arg);
+        }
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
     }
-    if (rebuild) {
-        return !RebuildArchive(in_name, out_name);
+    double start = GetTime();
+    ThreadPool pool(num_threads);
+    Stats stats;
+    Trace trace;
+    ToolContext context;
+    context.m_pool = &pool;
+    context.m_default_level = level;
+    context.m_incompressible = incompressible;
+    if (print_stats || !stats_json_name.empty()) {
+        context.m_stats = &stats;
+    }
+    if (!trace_name.empty()) {
+        context.m_trace = &trace;
+    }
+    if (!args.empty() && args[0] == "extract") {
+        if (args.size() < 4 || (args.size() % 2) != 0) {
+            std::cout << "Invalid number of arguments" << std::endl;
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        std::vector<uint32_t> indices;
+        std::vector<std::string> out_names;
+        for (size_t i = 2; i < args.size(); i += 2) {
+            char *end;
+            unsigned long index = strtoul(args[i].c_str(), &end, 10);
+            if (args[i].empty() || *end != '\0' || index > UINT32_MAX) {
+                std::cout << "Invalid entry index " << args[i] << "." << std::endl;
+                return 1;
+            }
+            indices.push_back(index);
+            out_names.push_back(args[i + 1]);
+        }
+        bool result = ExtractEntries(args[1], indices, out_names, context);
+        result = WriteReports(context, GetTime() - start, print_stats, stats_json_name, trace_name) && result;
+        return !result;
+    }
+    bool batch = !args.empty() && args[0] == "batch";
+    std::vector<std::string> in_names;
+    if (batch) {
+        for (size_t i = 1; i < args.size(); i++) {
+            if (args[i][0] == '@') {
+                if (!ReadResponseFile(args[i].substr(1), in_names)) {
+                    std::cout << "Failed to read " << args[i].substr(1) << "." << std::endl;
+                    return 1;
+                }
+            } else {
+                in_names.push_back(args[i]);
+            }
+        }
+        if (in_names.empty()) {
+            std::cout << "No inputs given" << std::endl;
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    } else if (args.size() != 1 && args.size() != 2) {
+        std::cout << "Invalid number of arguments" << std::endl;
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    CompressionCache cache(cache_dir, cache_limit * 1024 * 1024);
+    if (!cache_dir.empty()) {
+        if (!cache.Init()) {
+            std::cout << "Failed to create " << cache_dir << "." << std::endl;
+            return 1;
+        }
+        context.m_cache = &cache;
+    }
+    bool result;
+    if (batch) {
+        result = ProcessBatch(in_names, context);
     } else {
-        return !ExtractArchive(in_name, out_name);
+        std::string out_name = args.size() == 2 ? args[1] : GetDefaultOutputName(args[0]);
+        result = ProcessInput(args[0], out_name, context);
     }
-}
\ No newline at end of file
+    if (context.m_cache) {
+        cache.Trim();
+    }
+    result = WriteReports(context, GetTime() - start, print_stats, stats_json_name, trace_name) && result;
+    return !result;
+}